@@ -1,4 +1,5 @@
 #include "backend_helper.h"
+#include "ipp-keywords.h"
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -12,6 +13,8 @@ static unsigned int HttpLocalTimeout = 5;
 
 Mappings *map;
 
+static void index_dest_options(PrinterCUPS *p);
+
 /*****************BackendObj********************************/
 BackendObj *get_new_BackendObj()
 {
@@ -22,9 +25,34 @@ BackendObj *get_new_BackendObj()
     b->dialogs = g_hash_table_new_full(g_str_hash, g_str_equal,
                                        (GDestroyNotify)free_string,
                                        (GDestroyNotify)free_Dialog);
+    b->printers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        NULL,
+                                        (GDestroyNotify)unref_PrinterCUPS);
     b->num_frontends = 0;
     b->obj_path = NULL;
     b->default_printer = NULL;
+    b->generation = 0;
+    memset(b->snapshots, 0, sizeof(b->snapshots));
+    b->snapshot_job = NULL;
+    b->snapshot_waiters = NULL;
+    b->discovery_job = NULL;
+    b->discovery_dialogs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 (GDestroyNotify)free_string,
+                                                 NULL);
+    b->batch_frontends = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               (GDestroyNotify)free_string,
+                                               NULL);
+    b->pending_events = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              (GDestroyNotify)free_string,
+                                              NULL);
+    /** keys are owned by the capabilities themselves **/
+    b->capabilities = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            NULL,
+                                            (GDestroyNotify)unref_PrinterCapabilities);
+    b->debounce_source = 0;
+    b->debounce_deadline = 0;
+    b->events_received = 0;
+    b->refreshes_run = 0;
     return b;
 }
 
@@ -85,9 +113,25 @@ void connect_to_dbus(BackendObj *b, char *obj_path)
     }
 }
 
+/** Take the dialog off the subscriber lists of the printers it lists **/
+static void unsubscribe_dialog(const char *dialog_name, Dialog *d)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, d->printers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_hash_table_remove(((PrinterCUPS *)value)->subscribers, dialog_name);
+}
+
 void add_frontend(BackendObj *b, const char *dialog_name)
 {
+    Dialog *old = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (old)
+        unsubscribe_dialog(dialog_name, old);
+
     Dialog *d = get_new_Dialog();
+    d->batch_signals = g_hash_table_contains(b->batch_frontends, dialog_name);
     g_hash_table_insert(b->dialogs, cpdbGetStringCopy(dialog_name), d);
     b->num_frontends++;
 }
@@ -97,9 +141,14 @@ void remove_frontend(BackendObj *b, const char *dialog_name)
     Dialog *d = (Dialog *)(g_hash_table_lookup(b->dialogs, dialog_name));
     if (d)
     {
+        set_dialog_cancel(b, dialog_name);  /** stop any printer discovery still running for it **/
+        unsubscribe_dialog(dialog_name, d);
         g_hash_table_remove(b->dialogs, dialog_name);
         b->num_frontends--;
+        prune_printer_registry(b);
+        log_string_pool_stats();
     }
+    g_hash_table_remove(b->batch_frontends, dialog_name);
     g_message("Removed Frontend entry for %s", dialog_name);
 }
 gboolean no_frontends(BackendObj *b)
@@ -120,8 +169,19 @@ int *get_dialog_cancel(BackendObj *b, const char *dialog_name)
 }
 void set_dialog_cancel(BackendObj *b, const char *dialog_name)
 {
-    int *x = get_dialog_cancel(b, dialog_name);
-    if (x) *x = 1;
+    Dialog *d = (Dialog *)(g_hash_table_lookup(b->dialogs, dialog_name));
+    if (d == NULL)
+        return;
+    d->cancel = 1;
+
+    /** The discovery goes on for the other dialogs it streams to **/
+    if (g_hash_table_remove(b->discovery_dialogs, dialog_name) &&
+        g_hash_table_size(b->discovery_dialogs) == 0 && b->discovery_job)
+    {
+        cancel_EnumJob(b->discovery_job);
+        unref_EnumJob(b->discovery_job);
+        b->discovery_job = NULL;
+    }
 }
 void reset_dialog_cancel(BackendObj *b, const char *dialog_name)
 {
@@ -365,7 +425,6 @@ gboolean dialog_contains_printer(BackendObj *b, const char *dialog_name, const c
 
 PrinterCUPS *add_printer_to_dialog(BackendObj *b, const char *dialog_name, const cups_dest_t *dest)
 {
-    char *printer_name = cpdbGetStringCopy(dest->name);
     Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
     if (d == NULL)
     {
@@ -376,8 +435,13 @@ PrinterCUPS *add_printer_to_dialog(BackendObj *b, const char *dialog_name, const
         return NULL;
     }
 
-    PrinterCUPS *p = get_new_PrinterCUPS(dest);
-    g_hash_table_insert(d->printers, printer_name, p);
+    PrinterCUPS *p = acquire_printer(b, dest);
+    if (p == NULL)
+        return NULL;
+
+    /** The dialog's table is keyed by the registry's copy of the name **/
+    g_hash_table_replace(d->printers, (char *)p->name, p);
+    g_hash_table_add(p->subscribers, cpdbGetStringCopy(dialog_name));
     return p;
 }
 
@@ -392,27 +456,201 @@ void remove_printer_from_dialog(BackendObj *b, const char *dialog_name, const ch
 	free(msg);
         return;
     }
+
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(d->printers, printer_name);
+    if (p)
+    {
+        /** printer_name may be the printer's own name, so keep the printer
+         * alive until the registry is done with it **/
+        ref_PrinterCUPS(p);
+        g_hash_table_remove(p->subscribers, dialog_name);
+    }
+
     g_hash_table_remove(d->printers, printer_name);
+    release_printer(b, printer_name);
+    unref_PrinterCUPS(p);
+}
+
+PrinterCUPS *acquire_printer(BackendObj *b, const cups_dest_t *dest)
+{
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(b->printers, dest->name);
+    if (p == NULL)
+    {
+        p = get_new_PrinterCUPS(dest);
+        if (p == NULL)
+            return NULL;
+
+        /** The registry itself holds the first reference **/
+        g_hash_table_insert(b->printers, (char *)p->name, p);
+        logdebug("Registered printer %s (%d printers shared)\n",
+                 p->name, g_hash_table_size(b->printers));
+    }
+    return ref_PrinterCUPS(p);
 }
 
-void send_printer_added_signal(BackendObj *b, const char *dialog_name, cups_dest_t *dest)
+/**
+ * Whether some dialog lists the printer. The reference count can't tell,
+ * as threads working on the printer hold references too.
+ */
+static gboolean printer_is_listed(PrinterCUPS *p)
 {
+    return g_hash_table_size(p->subscribers) > 0;
+}
 
-    if (dest == NULL)
+void release_printer(BackendObj *b, const char *printer_name)
+{
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(b->printers, printer_name);
+    if (p == NULL)
+        return;
+
+    /** Listed by no dialog any more; whoever else still holds a reference
+     * (a warm-up, a revalidation) keeps its own **/
+    if (!printer_is_listed(p))
+    {
+        logdebug("Unregistering printer %s\n", printer_name);
+        g_hash_table_remove(b->printers, printer_name);
+    }
+}
+
+static gboolean printer_is_unused(gpointer key, gpointer value, gpointer user_data)
+{
+    return !printer_is_listed((PrinterCUPS *)value);
+}
+
+void prune_printer_registry(BackendObj *b)
+{
+    guint n = g_hash_table_foreach_remove(b->printers, printer_is_unused, NULL);
+    if (n)
+        logdebug("Pruned %u unused printers from the registry\n", n);
+}
+
+/**************Batched printer signals**********************/
+typedef struct _BatchFlush
+{
+    BackendObj *b;
+    char *dialog_name;
+} BatchFlush;
+
+static void free_BatchFlush(gpointer data)
+{
+    BatchFlush *f = (BatchFlush *)data;
+    free(f->dialog_name);
+    free(f);
+}
+
+static gboolean batch_timeout(gpointer user_data)
+{
+    BatchFlush *f = (BatchFlush *)user_data;
+    Dialog *d = (Dialog *)g_hash_table_lookup(f->b->dialogs, f->dialog_name);
+    if (d)
+    {
+        d->batch_source = 0;
+        flush_printer_signals(f->b, f->dialog_name);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_printer_signals(BackendObj *b, Dialog *d, const char *dialog_name)
+{
+    if (d->batch_source)
+        return;
+
+    BatchFlush *f = (BatchFlush *)malloc(sizeof(BatchFlush));
+    f->b = b;
+    f->dialog_name = cpdbGetStringCopy(dialog_name);
+    d->batch_source = g_timeout_add_full(G_PRIORITY_DEFAULT, SIGNAL_BATCH_MSEC,
+                                         batch_timeout, f, free_BatchFlush);
+}
+
+static void emit_ext_signal(BackendObj *b, const char *dialog_name,
+                            const char *signal_name, GVariant *parameters)
+{
+    GError *error = NULL;
+    g_dbus_connection_emit_signal(b->dbus_connection,
+                                  dialog_name,
+                                  b->obj_path,
+                                  CUPS_EXT_INTERFACE,
+                                  signal_name,
+                                  parameters,
+                                  &error);
+    g_assert_no_error(error);
+}
+
+void enable_batched_signals(BackendObj *b, const char *dialog_name)
+{
+    g_hash_table_add(b->batch_frontends, cpdbGetStringCopy(dialog_name));
+
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d)
+        d->batch_signals = TRUE;
+    logdebug("Batching printer signals for %s\n", dialog_name);
+}
+
+void flush_printer_signals(BackendObj *b, const char *dialog_name)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GVariantBuilder builder;
+    GVariant *printers;
+
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d == NULL)
+        return;
+
+    if (d->batch_source)
+    {
+        g_source_remove(d->batch_source);
+        d->batch_source = 0;
+    }
+
+    if (g_hash_table_size(d->pending_removed))
+    {
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ss)"));
+        g_hash_table_iter_init(&iter, d->pending_removed);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_variant_builder_add(&builder, "(ss)", (char *)key, "CUPS");
+
+        logdebug("Sending %u removed printers to %s\n",
+                 g_hash_table_size(d->pending_removed), dialog_name);
+        emit_ext_signal(b, dialog_name, CUPS_SIGNAL_PRINTERS_REMOVED,
+                        g_variant_new("(a(ss))", &builder));
+        g_hash_table_remove_all(d->pending_removed);
+    }
+
+    if (g_hash_table_size(d->pending_added))
+    {
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a" CPDB_PRINTER_ARGS));
+        g_hash_table_iter_init(&iter, d->pending_added);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_variant_builder_add_value(&builder, (GVariant *)value);
+        printers = g_variant_builder_end(&builder);
+
+        logdebug("Sending %u added printers to %s\n",
+                 g_hash_table_size(d->pending_added), dialog_name);
+        emit_ext_signal(b, dialog_name, CUPS_SIGNAL_PRINTERS_ADDED,
+                        g_variant_new_tuple(&printers, 1));
+        g_hash_table_remove_all(d->pending_added);
+    }
+}
+
+void send_printer_added_signal(BackendObj *b, const char *dialog_name, PrinterCUPS *p)
+{
+
+    if (p == NULL)
     {
         MSG_LOG("Failed to send printer added signal.\n", ERR);
         exit(EXIT_FAILURE);
     }
-    char *printer_name = cpdbGetStringCopy(dest->name);
-    GVariant *gv = g_variant_new(CPDB_PRINTER_ADDED_ARGS,
-                                 printer_name,                                   //id
-                                 printer_name,                                   //name
-                                 cups_retrieve_string(dest, "printer-info"),     //info
-                                 cups_retrieve_string(dest, "printer-location"), //location
-                                 cups_retrieve_string(dest, "printer-make-and-model"),
-                                 cups_is_accepting_jobs(dest),
-                                 cups_printer_state(dest),
-                                 "CUPS");
+    GVariant *gv = pack_printer_summary(p);
+
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d && d->batch_signals)
+    {
+        g_hash_table_replace(d->pending_added, cpdbGetStringCopy(p->name),
+                             g_variant_ref_sink(gv));
+        schedule_printer_signals(b, d, dialog_name);
+        return;
+    }
 
     GError *error = NULL;
     g_dbus_connection_emit_signal(b->dbus_connection,
@@ -427,6 +665,17 @@ void send_printer_added_signal(BackendObj *b, const char *dialog_name, cups_dest
 
 void send_printer_removed_signal(BackendObj *b, const char *dialog_name, const char *printer_name)
 {
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d && d->batch_signals)
+    {
+        /** A removal always goes out before the additions of the same batch,
+         * so an addition still pending for the printer is simply dropped **/
+        g_hash_table_remove(d->pending_added, printer_name);
+        g_hash_table_add(d->pending_removed, cpdbGetStringCopy(printer_name));
+        schedule_printer_signals(b, d, dialog_name);
+        return;
+    }
+
     GError *error = NULL;
     g_dbus_connection_emit_signal(b->dbus_connection,
                                   dialog_name,
@@ -446,7 +695,7 @@ void send_printer_state_changed_signal(BackendObj *b, const char *dialog_name, c
                                   dialog_name,
                                   b->obj_path,
                                   "org.openprinting.PrintBackend",
-                                  CPDB_SIGNAL_PRINTER_REMOVED,
+                                  CPDB_SIGNAL_PRINTER_STATE_CHANGED,
                                   g_variant_new("(ssbs)", printer_name, printer_state,
                                                 printer_is_accepting_jobs, "CUPS"),
                                   &error);
@@ -459,7 +708,8 @@ void notify_removed_printers(BackendObj *b, const char *dialog_name, GHashTable
     if (!d) return;
 
     GHashTable *prev = d->printers;
-    GList *prevlist = g_hash_table_get_keys(prev);
+    GList *keys = g_hash_table_get_keys(prev);
+    GList *prevlist = keys;
     printf("Notifying removed printers.\n");
     gpointer printer_name = NULL;
     while (prevlist)
@@ -473,6 +723,7 @@ void notify_removed_printers(BackendObj *b, const char *dialog_name, GHashTable
         }
         prevlist = prevlist->next;
     }
+    g_list_free(keys);
 }
 
 void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table)
@@ -486,6 +737,7 @@ void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *n
     gpointer printer_name;
     gpointer value;
     cups_dest_t *dest = NULL;
+    PrinterCUPS *p;
     g_hash_table_iter_init(&iter, new_table);
     while (g_hash_table_iter_next(&iter, &printer_name, &value))
     {
@@ -493,8 +745,9 @@ void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *n
         {
             g_message("Printer %s added\n", (char *)printer_name);
             dest = (cups_dest_t *)value;
-            send_printer_added_signal(b, dialog_name, dest);
-            add_printer_to_dialog(b, dialog_name, dest);
+            p = add_printer_to_dialog(b, dialog_name, dest);
+            if (p)
+                send_printer_added_signal(b, dialog_name, p);
         }
     }
 }
@@ -509,184 +762,932 @@ gboolean get_hide_temp(BackendObj *b, char *dialog_name)
     Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
     return d->hide_temp;
 }
+static void apply_snapshot_to_dialog(BackendObj *b, PrinterSnapshot *snapshot, gpointer user_data)
+{
+    char *dialog_name = (char *)user_data;
+    Dialog *d = find_dialog(b, dialog_name);
+    if (d == NULL)
+        return;
+
+    /** Already in sync with this very snapshot **/
+    if (d->snapshot == snapshot)
+        return;
+
+    notify_removed_printers(b, dialog_name, snapshot->printers);
+    notify_added_printers(b, dialog_name, snapshot->printers);
+
+    unref_PrinterSnapshot(d->snapshot);
+    d->snapshot = ref_PrinterSnapshot(snapshot);
+}
 void refresh_printer_list(BackendObj *b, char *dialog_name)
 {
-    GHashTable *new_printers;
-    new_printers = cups_get_printers(get_hide_temp(b, dialog_name), get_hide_remote(b, dialog_name));
-    notify_removed_printers(b, dialog_name, new_printers);
-    notify_added_printers(b, dialog_name, new_printers);
+    get_printer_snapshot(b, get_hide_temp(b, dialog_name), get_hide_remote(b, dialog_name),
+                         apply_snapshot_to_dialog,
+                         cpdbGetStringCopy(dialog_name), (GDestroyNotify)free_string);
 }
-GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name)
+gboolean dialog_accepts_printer(Dialog *d, cups_dest_t *dest)
 {
-    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
-    if (d == NULL)
+    if (d->hide_temp && cups_is_temporary(dest))
+        return FALSE;
+    if (d->hide_remote && cups_is_remote(dest))
+        return FALSE;
+    return TRUE;
+}
+void refresh_all_printer_lists(BackendObj *b)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    /** Dialogs with the same settings share one snapshot, and all of them
+     * are derived from a single unfiltered enumeration **/
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
     {
-        MSG_LOG("Invalid dialog name.\n", ERR);
-        return NULL;
+        refresh_printer_list(b, (char *)key);
     }
-    return d->printers;
 }
-PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+gboolean add_printer_to_dialogs(BackendObj *b, const char *printer_name)
 {
-    GHashTable *printers = get_dialog_printers(b, dialog_name);
-    g_assert_nonnull(printers);
-    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
-    if (p == NULL)
+    GHashTableIter iter;
+    gpointer key, value;
+    cups_dest_t *dest;
+
+    dest = cupsGetNamedDest(CUPS_HTTP_DEFAULT, printer_name, NULL);
+    if (dest == NULL)
     {
-        printf("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
-        exit(EXIT_FAILURE);
+        logwarn("Unable to look up added printer %s: %s\n",
+                printer_name, cupsLastErrorString());
+        return FALSE;
     }
-    return p;
+
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        Dialog *d = (Dialog *)value;
+        if (g_hash_table_contains(d->printers, dest->name) ||
+            !dialog_accepts_printer(d, dest))
+            continue;
+
+        g_message("Printer %s added\n", dest->name);
+        PrinterCUPS *p = add_printer_to_dialog(b, (char *)key, dest);
+        if (p)
+            send_printer_added_signal(b, (char *)key, p);
+    }
+
+    cupsFreeDests(1, dest);
+    return TRUE;
 }
-cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+
+/** Update printer-state in the fetched attributes, if there are any **/
+static void set_printer_state_attribute(PrinterCUPS *p, int printer_state)
 {
-    GHashTable *printers = get_dialog_printers(b, dialog_name);
-    g_assert_nonnull(printers);
-    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
-    if (p == NULL)
+    ipp_attribute_t *attr;
+
+    g_rec_mutex_lock(&p->lock);
+    if (p->attrs && (attr = ippFindAttribute(p->attrs, "printer-state", IPP_TAG_ENUM)) != NULL)
     {
-        printf("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
+        ippSetInteger(p->attrs, &attr, 0, printer_state);
+        p->state_time = g_get_monotonic_time();
     }
-    return p->dest;
+    g_rec_mutex_unlock(&p->lock);
 }
-/***************************PrinterObj********************************/
-PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest)
+
+gboolean update_printer_state(BackendObj *b, const char *printer_name,
+                              guint printer_state, gboolean printer_is_accepting_jobs)
 {
-    PrinterCUPS *p = (PrinterCUPS *)(malloc(sizeof(PrinterCUPS)));
+    GHashTableIter iter;
+    gpointer key, value;
 
-    /** Make a copy of dest, because there are no guarantees 
-     * whether dest will always exist or if it will be freed**/
-    cups_dest_t *dest_copy = NULL;
-    cupsCopyDest((cups_dest_t *)dest, 0, &dest_copy);
-    if (dest_copy == NULL)
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(b->printers, printer_name);
+    if (p == NULL || g_hash_table_size(p->subscribers) == 0)
+        return FALSE;
+
+    if (printer_state >= IPP_PSTATE_IDLE && printer_state <= IPP_PSTATE_STOPPED)
+        p->summary.state = intern_string(map->state[printer_state]);
+    else
+        p->summary.state = intern_string("NA");
+    p->summary.accepting_jobs = printer_is_accepting_jobs;
+
+    set_printer_state_attribute(p, printer_state);
+
+    g_hash_table_iter_init(&iter, p->subscribers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
     {
-        MSG_LOG("Error creating PrinterCUPS", WARN);
-        return NULL;
+        send_printer_state_changed_signal(b, (char *)key, p->name,
+                                          p->summary.state, p->summary.accepting_jobs);
     }
-    p->dest = dest_copy;
-    p->name = dest_copy->name;
-    p->http = NULL;
-    p->dinfo = NULL;
-    p->stream_socket_path = NULL;
-
-    return p;
+    return TRUE;
 }
 
-void free_PrinterCUPS(PrinterCUPS *p)
+void refresh_printer(BackendObj *b, const char *printer_name)
 {
-    printf("Freeing printerCUPS \n");
+    GHashTableIter iter;
+    gpointer key, value;
+    cups_dest_t *dest;
+
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(b->printers, printer_name);
+    if (p == NULL)
+        return;
+
+    dest = cupsGetNamedDest(CUPS_HTTP_DEFAULT, printer_name, NULL);
+    if (dest == NULL)
+    {
+        logwarn("Unable to look up modified printer %s: %s\n",
+                printer_name, cupsLastErrorString());
+        return;
+    }
+
+    g_rec_mutex_lock(&p->lock);
     cupsFreeDests(1, p->dest);
+    p->dest = dest;
+    index_dest_options(p);
+
+    /** The dest info and the attributes were fetched for the old
+     * destination **/
     if (p->dinfo)
     {
         cupsFreeDestInfo(p->dinfo);
+        p->dinfo = NULL;
     }
-}
+    g_hash_table_remove_all(p->supported_attrs);
+    g_hash_table_remove_all(p->default_attrs);
+    forget_printer_attributes(p);
 
-gboolean ensure_printer_connection(PrinterCUPS *p)
-{
-    if (p->http)
-        return TRUE;
+    free_PrinterSummary(&p->summary);
+    fill_PrinterSummary(&p->summary, p);
+    g_rec_mutex_unlock(&p->lock);
 
-    int temp = FALSE;
-    if (cups_is_temporary(p->dest)) temp = TRUE;
+    logdebug("Refreshed the destination of %s\n", printer_name);
+    g_hash_table_iter_init(&iter, p->subscribers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        send_printer_state_changed_signal(b, (char *)key, p->name,
+                                          p->summary.state, p->summary.accepting_jobs);
+    }
+}
 
-    p->http = cupsConnectDest(p->dest, CUPS_DEST_FLAGS_NONE, 300, NULL, NULL, 0, NULL, NULL);
-    if (p->http == NULL)
-        return FALSE;
+/**************Notifier event debouncing********************/
+static gboolean debounce_timeout(gpointer user_data)
+{
+    BackendObj *b = (BackendObj *)user_data;
+    b->debounce_source = 0;
+    flush_printer_events(b);
+    return G_SOURCE_REMOVE;
+}
 
-    // update dest after temporary CUPS queue has been created
-    if (temp)
+void queue_printer_event(BackendObj *b, const char *printer_name, int event)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 delay;
+    int events = GPOINTER_TO_INT(g_hash_table_lookup(b->pending_events, printer_name));
+
+    b->events_received++;
+    invalidate_printer_snapshots(b);
+
+    /** A deletion cancels an addition or modification that wasn't applied
+     * yet, while an addition after a deletion means the queue was re-created.
+     * A printer which came and went before any dialog learnt of it leaves
+     * nothing to apply, so that no removal is sent for it. **/
+    if ((event & PRINTER_EVENT_DELETED) && (events & ~PRINTER_EVENT_MODIFIED) == PRINTER_EVENT_ADDED &&
+        !g_hash_table_contains(b->printers, printer_name))
     {
-        cups_dest_t *new_dest = cupsGetNamedDest(p->http, p->name, NULL);
-        cupsFreeDests(1, p->dest);
-        p->dest = new_dest;
+        g_hash_table_remove(b->pending_events, printer_name);
+    }
+    else
+    {
+        if (event & PRINTER_EVENT_DELETED)
+            events = (events & ~(PRINTER_EVENT_ADDED | PRINTER_EVENT_MODIFIED)) | PRINTER_EVENT_DELETED;
+        else
+            events |= event;
+        g_hash_table_replace(b->pending_events, cpdbGetStringCopy(printer_name),
+                             GINT_TO_POINTER(events));
     }
 
-    p->dinfo = cupsCopyDestInfo(p->http, p->dest);
-    if (p->dinfo == NULL)
-        return FALSE;
+    if (b->debounce_source)
+        g_source_remove(b->debounce_source);
+    else
+        b->debounce_deadline = now + NOTIFIER_MAX_DELAY_MSEC * 1000;
 
-    return TRUE;
+    delay = MIN(NOTIFIER_QUIET_MSEC * 1000, b->debounce_deadline - now);
+    b->debounce_source = g_timeout_add(MAX(delay, 0) / 1000, debounce_timeout, b);
 }
 
-int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name)
+void flush_printer_events(BackendObj *b)
 {
-    char **values;
-    ensure_printer_connection(p);
-    ipp_attribute_t *attrs =
-        cupsFindDestSupported(p->http, p->dest, p->dinfo, option_name);
-    int i, count = ippGetCount(attrs);
-    if (!count)
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean refresh_all;
+    guint n = g_hash_table_size(b->pending_events);
+
+    if (b->debounce_source)
     {
-        *supported_values = NULL;
-        return 0;
+        g_source_remove(b->debounce_source);
+        b->debounce_source = 0;
     }
+    if (n == 0)
+        return;
 
-    values = malloc(sizeof(char *) * count);
+    b->refreshes_run++;
+    loginfo("Applying %u printer changes (%lu notifier events, %lu refreshes so far)\n",
+            n, (unsigned long)b->events_received, (unsigned long)b->refreshes_run);
 
-    for (i = 0; i < count; i++)
+    /** Past a few printers a single enumeration is cheaper than looking
+     * up every added printer on its own **/
+    refresh_all = n > NOTIFIER_MAX_NAMED_LOOKUPS;
+
+    g_hash_table_iter_init(&iter, b->pending_events);
+    while (g_hash_table_iter_next(&iter, &key, &value))
     {
-        values[i] = extract_ipp_attribute(attrs, i, option_name);
+        int events = GPOINTER_TO_INT(value);
+
+        if (events & PRINTER_EVENT_DELETED)
+        {
+            invalidate_printer_capabilities(b, (char *)key);
+            remove_printer_from_dialogs(b, (char *)key);
+        }
+        if ((events & PRINTER_EVENT_ADDED) && !refresh_all &&
+            !add_printer_to_dialogs(b, (char *)key))
+            refresh_all = TRUE;
+        if ((events & PRINTER_EVENT_MODIFIED) && !(events & PRINTER_EVENT_DELETED))
+            refresh_printer(b, (char *)key);
     }
-    *supported_values = values;
-    return count;
+    g_hash_table_remove_all(b->pending_events);
+
+    if (refresh_all)
+        refresh_all_printer_lists(b);
 }
 
-char *get_orientation_default(PrinterCUPS *p)
+static void stream_printer_to_dialog(BackendObj *b, unsigned flags, cups_dest_t *dest, gpointer user_data)
 {
-    const char *def_value = cupsGetOption(CUPS_ORIENTATION, p->dest->num_options, p->dest->options);
-    if (def_value)
+    const char *dialog_name = (const char *)user_data;
+    Dialog *d = find_dialog(b, dialog_name);
+
+    if (d == NULL || d->cancel)
+        return;
+
+    if (flags & CUPS_DEST_FLAGS_REMOVED)
     {
-        switch (def_value[0])
+        if (g_hash_table_contains(d->printers, dest->name))
         {
-        case '0':
-            return cpdbGetStringCopy("automatic-rotation");
-        default:
-            return cpdbGetStringCopy(ippEnumString(CUPS_ORIENTATION, atoi(def_value)));
+            send_printer_removed_signal(b, dialog_name, dest->name);
+            remove_printer_from_dialog(b, dialog_name, dest->name);
         }
+        return;
     }
-    ensure_printer_connection(p);
-    ipp_attribute_t *attr = NULL;
 
-    attr = cupsFindDestDefault(p->http, p->dest, p->dinfo, CUPS_ORIENTATION);
-    if (!attr)
-        return cpdbGetStringCopy("NA");
-
-    const char *str = ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, 0));
-    if (strcmp("0", str) == 0)
-        str = "automatic-rotation";
-    return cpdbGetStringCopy(str);
+    if (!g_hash_table_contains(d->printers, dest->name) && dialog_accepts_printer(d, dest))
+    {
+        loginfo("Found printer : %s\n", dest->name);
+        PrinterCUPS *p = add_printer_to_dialog(b, dialog_name, dest);
+        if (p)
+            send_printer_added_signal(b, dialog_name, p);
+    }
 }
 
-int get_job_creation_attributes(PrinterCUPS *p, char ***values)
+static void stream_printer_to_dialogs(BackendObj *b, unsigned flags, cups_dest_t *dest, gpointer user_data)
 {
-    return get_supported(p, values, "job-creation-attributes");
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, b->discovery_dialogs);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        stream_printer_to_dialog(b, flags, dest, key);
 }
 
-char *get_default(PrinterCUPS *p, char *option_name)
+/**
+ * The discovery enumerated everything unfiltered, so keep it as a snapshot.
+ * Dialogs which joined it late missed the printers streamed before, and
+ * get them from the snapshot.
+ */
+static void discovery_done(EnumJob *job)
 {
-    /** first take care of special cases**/
-    if (strcmp(option_name, CUPS_ORIENTATION) == 0)
-        return get_orientation_default(p);
+    BackendObj *b = job->b;
+    GHashTable *dialogs = b->discovery_dialogs;
+    GHashTableIter iter;
+    gpointer key;
+    Dialog *d;
+
+    unref_PrinterSnapshot(store_base_snapshot(job));
+    unref_EnumJob(b->discovery_job);
+    b->discovery_job = NULL;
+    b->discovery_dialogs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 (GDestroyNotify)free_string,
+                                                 NULL);
+
+    g_hash_table_iter_init(&iter, dialogs);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+    {
+        refresh_printer_list(b, (char *)key);
+        if ((d = find_dialog(b, (char *)key)) != NULL)
+            warm_up_printers(b, d->printers);
+    }
+    g_hash_table_destroy(dialogs);
+}
+
+void start_printer_discovery(BackendObj *b, const char *dialog_name)
+{
+    PrinterSnapshot *base = b->snapshots[0];    /** the unfiltered one **/
+    Dialog *d = find_dialog(b, dialog_name);
+    if (d == NULL)
+        return;
+
+    d->cancel = 0;
+    if (base && base->generation == b->generation)
+    {
+        logdebug("No printer changes since the last enumeration, answering %s from it\n",
+                 dialog_name);
+        refresh_printer_list(b, (char *)dialog_name);
+        warm_up_printers(b, d->printers);
+        return;
+    }
+
+    g_hash_table_add(b->discovery_dialogs, cpdbGetStringCopy(dialog_name));
+    if (b->discovery_job)
+    {
+        logdebug("Printer discovery for %s joins the one already queued\n", dialog_name);
+        return;
+    }
+    b->discovery_job = enumerate_printers_async(b, 3000, FALSE, FALSE,
+                                                stream_printer_to_dialogs, discovery_done,
+                                                NULL, NULL);
+}
+
+void remove_printer_from_dialogs(BackendObj *b, const char *printer_name)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, b->dialogs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        Dialog *d = (Dialog *)value;
+        if (!g_hash_table_contains(d->printers, printer_name))
+            continue;
+
+        g_message("Printer %s removed\n", printer_name);
+        send_printer_removed_signal(b, (char *)key, printer_name);
+        remove_printer_from_dialog(b, (char *)key, printer_name);
+    }
+}
+GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name)
+{
+    Dialog *d = (Dialog *)g_hash_table_lookup(b->dialogs, dialog_name);
+    if (d == NULL)
+    {
+        MSG_LOG("Invalid dialog name.\n", ERR);
+        return NULL;
+    }
+    return d->printers;
+}
+PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+{
+    GHashTable *printers = get_dialog_printers(b, dialog_name);
+    g_assert_nonnull(printers);
+    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
+    if (p == NULL)
+    {
+        printf("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name)
+{
+    GHashTable *printers = get_dialog_printers(b, dialog_name);
+    g_assert_nonnull(printers);
+    PrinterCUPS *p = (g_hash_table_lookup(printers, printer_name));
+    if (p == NULL)
+    {
+        printf("Printer '%s' does not exist for the dialog %s.\n", printer_name, dialog_name);
+    }
+    return p->dest;
+}
+/***************************PrinterObj********************************/
+
+PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest)
+{
+    PrinterCUPS *p = (PrinterCUPS *)(malloc(sizeof(PrinterCUPS)));
+
+    /** Make a copy of dest, because there are no guarantees 
+     * whether dest will always exist or if it will be freed**/
+    cups_dest_t *dest_copy = NULL;
+    cupsCopyDest((cups_dest_t *)dest, 0, &dest_copy);
+    if (dest_copy == NULL)
+    {
+        MSG_LOG("Error creating PrinterCUPS", WARN);
+        free(p);
+        return NULL;
+    }
+    p->ref_count = 1;
+    p->dest = dest_copy;
+    p->name = cpdbGetStringCopy(dest_copy->name);
+    p->http = NULL;
+    p->dinfo = NULL;
+    p->stream_socket_path = NULL;
+    p->attrs = NULL;
+    p->state_time = 0;
+    p->media_db = NULL;
+    p->warmed_up = 0;
+    g_rec_mutex_init(&p->lock);
+    p->dest_options = NULL;
+    index_dest_options(p);
+    p->supported_attrs = g_hash_table_new(g_str_hash, g_str_equal);
+    p->default_attrs = g_hash_table_new(g_str_hash, g_str_equal);
+    fill_PrinterSummary(&p->summary, p);
+    p->subscribers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           (GDestroyNotify)free_string,
+                                           NULL);
+
+    return p;
+}
+
+void free_PrinterCUPS(PrinterCUPS *p)
+{
+    logdebug("Freeing printer %s\n", p->name);
+    cupsFreeDests(1, p->dest);
+    if (p->dinfo)
+    {
+        cupsFreeDestInfo(p->dinfo);
+    }
+    if (p->http)
+    {
+        httpClose(p->http);
+    }
+    g_hash_table_destroy(p->subscribers);
+    g_hash_table_destroy(p->dest_options);
+    free_PrinterSummary(&p->summary);
+    g_hash_table_destroy(p->supported_attrs);
+    g_hash_table_destroy(p->default_attrs);
+    ippDelete(p->attrs);
+    unref_MediaDatabase(p->media_db);
+    g_rec_mutex_clear(&p->lock);
+    free(p->name);
+    free(p);
+}
+
+static char *summary_string(PrinterCUPS *p, const char *option_name)
+{
+    const char *val = printer_option(p, option_name);
+    return cpdbGetStringCopy(val ? val : "NA");
+}
+
+void fill_PrinterSummary(PrinterSummary *s, PrinterCUPS *p)
+{
+    s->info = summary_string(p, "printer-info");
+    s->location = summary_string(p, "printer-location");
+    s->make_and_model = summary_string(p, "printer-make-and-model");
+    s->state = printer_dest_state(p);
+    s->accepting_jobs = printer_accepts_jobs(p);
+}
+
+void free_PrinterSummary(PrinterSummary *s)
+{
+    free(s->info);
+    free(s->location);
+    free(s->make_and_model);
+}
+
+GVariant *pack_printer_summary(const PrinterCUPS *p)
+{
+    const PrinterSummary *s = &p->summary;
+    return g_variant_new(CPDB_PRINTER_ARGS,
+                         p->name,               //id
+                         p->name,               //name
+                         s->info,
+                         s->location,
+                         s->make_and_model,
+                         s->accepting_jobs,
+                         s->state,
+                         BACKEND_NAME);
+}
+
+PrinterCUPS *ref_PrinterCUPS(PrinterCUPS *p)
+{
+    g_atomic_int_inc(&p->ref_count);
+    return p;
+}
+
+void unref_PrinterCUPS(PrinterCUPS *p)
+{
+    if (p && g_atomic_int_dec_and_test(&p->ref_count))
+        free_PrinterCUPS(p);
+}
+
+static gboolean connect_printer(PrinterCUPS *p);
+
+/**
+ * (Re)build the index of p->dest->options. The keys and values point into
+ * p->dest, so it has to be rebuilt whenever p->dest is replaced.
+ */
+static void index_dest_options(PrinterCUPS *p)
+{
+    int i;
+
+    if (p->dest_options)
+        g_hash_table_destroy(p->dest_options);
+    p->dest_options = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < p->dest->num_options; i++)
+    {
+        /** cupsGetOption() finds the first of duplicate options, so keep that one **/
+        if (!g_hash_table_contains(p->dest_options, p->dest->options[i].name))
+            g_hash_table_insert(p->dest_options,
+                                p->dest->options[i].name,
+                                p->dest->options[i].value);
+    }
+}
+
+const char *printer_option(PrinterCUPS *p, const char *option_name)
+{
+    return g_hash_table_lookup(p->dest_options, option_name);
+}
+
+/**
+ * Answer from the memo table, or ask find() once and remember the answer,
+ * even if there is none
+ */
+static ipp_attribute_t *
+find_dest_attribute(PrinterCUPS *p, GHashTable *memo, const char *option_name,
+                    ipp_attribute_t *(*find)(http_t *, cups_dest_t *,
+                                             cups_dinfo_t *, const char *))
+{
+    gpointer attr = NULL;
+
+    g_rec_mutex_lock(&p->lock);
+    if (!g_hash_table_lookup_extended(memo, option_name, NULL, &attr) &&
+        connect_printer(p))
+    {
+        attr = find(p->http, p->dest, p->dinfo, option_name);
+        g_hash_table_insert(memo, (gpointer)intern_string(option_name), attr);
+    }
+    g_rec_mutex_unlock(&p->lock);
+    return (ipp_attribute_t *)attr;
+}
+
+ipp_attribute_t *printer_supported(PrinterCUPS *p, const char *option_name)
+{
+    return find_dest_attribute(p, p->supported_attrs, option_name, cupsFindDestSupported);
+}
+
+ipp_attribute_t *printer_default(PrinterCUPS *p, const char *option_name)
+{
+    return find_dest_attribute(p, p->default_attrs, option_name, cupsFindDestDefault);
+}
+
+const char *printer_dest_state(PrinterCUPS *p)
+{
+    const char *state = printer_option(p, "printer-state");
+    if (state == NULL)
+        return "NA";
+    return map->state[state[0] - '0'];
+}
+
+gboolean printer_accepts_jobs(PrinterCUPS *p)
+{
+    return cpdbGetBoolean(printer_option(p, "printer-is-accepting-jobs"));
+}
+
+gboolean printer_is_temporary(PrinterCUPS *p)
+{
+    return printer_option(p, "printer-uri-supported") ? FALSE : TRUE;
+}
+
+gboolean printer_is_remote(PrinterCUPS *p)
+{
+    const char *type = printer_option(p, "printer-type");
+    if (type == NULL)
+        return FALSE;
+    return (strtoul(type, NULL, 10) & CUPS_PRINTER_REMOTE) ? TRUE : FALSE;
+}
+
+gboolean ensure_printer_connection(PrinterCUPS *p)
+{
+    gboolean ret;
+
+    g_rec_mutex_lock(&p->lock);
+    ret = connect_printer(p);
+    g_rec_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static gboolean connect_printer(PrinterCUPS *p)
+{
+    if (p->http && p->dinfo)
+        return TRUE;
+
+    if (p->http == NULL)
+    {
+        int temp = FALSE;
+        if (printer_is_temporary(p)) temp = TRUE;
+
+        p->http = cupsConnectDest(p->dest, CUPS_DEST_FLAGS_NONE, 300, NULL, NULL, 0, NULL, NULL);
+        if (p->http == NULL)
+            return FALSE;
+
+        // update dest after temporary CUPS queue has been created
+        if (temp)
+        {
+            cups_dest_t *new_dest = cupsGetNamedDest(p->http, p->name, NULL);
+            cupsFreeDests(1, p->dest);
+            p->dest = new_dest;
+            index_dest_options(p);
+        }
+    }
+
+    /** Dropped by refresh_printer() when the printer was modified **/
+    p->dinfo = cupsCopyDestInfo(p->http, p->dest);
+    if (p->dinfo == NULL)
+        return FALSE;
+
+    return TRUE;
+}
+
+int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name)
+{
+    char **values;
+    ipp_attribute_t *attrs = printer_supported(p, option_name);
+    int i, count = ippGetCount(attrs);
+    if (!count)
+    {
+        *supported_values = NULL;
+        return 0;
+    }
+
+    values = malloc(sizeof(char *) * count);
+
+    for (i = 0; i < count; i++)
+    {
+        values[i] = extract_ipp_attribute(attrs, i, option_name);
+    }
+    *supported_values = values;
+    return count;
+}
+
+static const char *lookup_orientation_default(PrinterCUPS *p)
+{
+    const char *def_value = printer_option(p, CUPS_ORIENTATION);
+    if (def_value)
+    {
+        switch (def_value[0])
+        {
+        case '0':
+            return "automatic-rotation";
+        default:
+            return ippEnumString(CUPS_ORIENTATION, atoi(def_value));
+        }
+    }
+    ipp_attribute_t *attr = printer_default(p, CUPS_ORIENTATION);
+    if (!attr)
+        return "NA";
+
+    const char *str = ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, 0));
+    if (strcmp("0", str) == 0)
+        str = "automatic-rotation";
+    return str;
+}
+
+char *get_orientation_default(PrinterCUPS *p)
+{
+    return cpdbGetStringCopy(lookup_orientation_default(p));
+}
+
+int get_job_creation_attributes(PrinterCUPS *p, char ***values)
+{
+    ipp_t *response;
+    ipp_attribute_t *attr = NULL;
+    int i, count;
+
+    g_rec_mutex_lock(&p->lock);
+    if ((response = get_printer_attributes(p)) != NULL)
+        attr = ippFindAttribute(response, "job-creation-attributes-supported", IPP_TAG_KEYWORD);
+    if (attr == NULL)
+    {
+        g_rec_mutex_unlock(&p->lock);
+        return get_supported(p, values, "job-creation-attributes");
+    }
+
+    count = ippGetCount(attr);
+    *values = count ? malloc(sizeof(char *) * count) : NULL;
+    for (i = 0; i < count; i++)
+        (*values)[i] = cpdbGetStringCopy(ippGetString(attr, i, NULL));
+    g_rec_mutex_unlock(&p->lock);
+    return count;
+}
+
+/**
+ * All the printer attributes the backend asks the printer for, so that
+ * they come in a single Get-Printer-Attributes request
+ */
+static const char *const printer_attributes[] = {
+    "job-creation-attributes-supported",
+    "media-col-ready",
+    "media-ready",
+    "printer-config-change-time",
+    "printer-state",
+    "printer-strings-uri",
+};
+
+/** Send a Get-Printer-Attributes request; the caller holds p->lock **/
+static ipp_t *request_printer_attributes(PrinterCUPS *p, int count, const char *const *names)
+{
+    ipp_t *request, *response;
+    const char *uri;
 
-    /** Generic cases next **/
     ensure_printer_connection(p);
-    ipp_attribute_t *def_attr = cupsFindDestDefault(p->http, p->dest, p->dinfo, option_name);
-    const char *def_value = cupsGetOption(option_name, p->dest->num_options, p->dest->options);
+    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    uri = printer_option(p, "printer-uri-supported");
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                 "printer-uri", NULL, uri);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                  "requested-attributes", count, NULL, names);
+
+    response = cupsDoRequest(p->http, request, "/");
+    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+    {
+        /* request failed */
+        logwarn("Unable to get the attributes of %s: %s\n", p->name, cupsLastErrorString());
+        ippDelete(response);
+        return NULL;
+    }
+    return response;
+}
+
+ipp_t *get_printer_attributes(PrinterCUPS *p)
+{
+    ipp_t *attrs;
+
+    g_rec_mutex_lock(&p->lock);
+    if (p->attrs == NULL)
+    {
+        p->attrs = request_printer_attributes(p, G_N_ELEMENTS(printer_attributes), printer_attributes);
+        p->state_time = g_get_monotonic_time();
+    }
+    attrs = p->attrs;
+    g_rec_mutex_unlock(&p->lock);
+    return attrs;
+}
+
+/**
+ * Ask the printer again for the attributes that change while it's listed,
+ * once the ones in p->attrs are older than PRINTER_STATE_TTL_SEC. The
+ * notifier only keeps the state of listed printers current, and only while
+ * it is connected. The caller holds p->lock.
+ */
+static void refresh_printer_status(PrinterCUPS *p)
+{
+    static const char *const status_attributes[] = {
+        "printer-config-change-time",
+        "printer-state",
+    };
+    ipp_t *fresh;
+    ipp_attribute_t *attr, *old;
+
+    if (p->attrs == NULL ||
+        g_get_monotonic_time() - p->state_time <= PRINTER_STATE_TTL_SEC * G_USEC_PER_SEC ||
+        (fresh = request_printer_attributes(p, G_N_ELEMENTS(status_attributes),
+                                            status_attributes)) == NULL)
+        return;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(status_attributes); i++)
+    {
+        if ((attr = ippFindAttribute(fresh, status_attributes[i], IPP_TAG_ZERO)) == NULL)
+            continue;
+        if ((old = ippFindAttribute(p->attrs, status_attributes[i], IPP_TAG_ZERO)) != NULL)
+            ippSetInteger(p->attrs, &old, 0, ippGetInteger(attr, 0));
+        else
+            ippCopyAttribute(p->attrs, attr, 0);
+    }
+    p->state_time = g_get_monotonic_time();
+    ippDelete(fresh);
+}
+
+void forget_printer_attributes(PrinterCUPS *p)
+{
+    g_rec_mutex_lock(&p->lock);
+    ippDelete(p->attrs);
+    p->attrs = NULL;
+    unref_MediaDatabase(p->media_db);
+    p->media_db = NULL;
+    g_rec_mutex_unlock(&p->lock);
+}
+
+/**************Printer warm-up******************************/
+/**
+ * Connecting to a printer and fetching its dest info and attributes takes
+ * a few round trips, so do it ahead of time for the local printers found by
+ * an enumeration, on a small pool of threads. The re-reads of cached
+ * options run on the same pool, so that the threads talking to printers
+ * in the background stay bounded.
+ */
+static GThreadPool *warmup_pool = NULL;
+
+typedef struct _BackgroundTask
+{
+    GFunc func;
+    gpointer data;
+} BackgroundTask;
+
+static void run_background_task(gpointer data, gpointer user_data)
+{
+    BackgroundTask *t = (BackgroundTask *)data;
+    t->func(t->data, NULL);
+    free(t);
+}
+
+/** CPDB_CUPS_WARMUP_THREADS overrides the pool size; 0 turns warm-up off **/
+static int warmup_threads()
+{
+    const char *val = getenv("CPDB_CUPS_WARMUP_THREADS");
+    if (val == NULL)
+        return WARMUP_THREADS;
+    return MAX(atoi(val), 0);
+}
+
+/** Run func(data) on the pool; it has a thread even with warm-up off **/
+static void push_background_task(GFunc func, gpointer data)
+{
+    BackgroundTask *t = (BackgroundTask *)malloc(sizeof(BackgroundTask));
+
+    if (warmup_pool == NULL)
+        warmup_pool = g_thread_pool_new(run_background_task, NULL,
+                                        MAX(warmup_threads(), 1), FALSE, NULL);
+    t->func = func;
+    t->data = data;
+    g_thread_pool_push(warmup_pool, t, NULL);
+}
+
+static gboolean unref_printer_cb(gpointer data)
+{
+    unref_PrinterCUPS((PrinterCUPS *)data);
+    return G_SOURCE_REMOVE;
+}
+
+static void warm_up_printer(gpointer data, gpointer user_data)
+{
+    PrinterCUPS *p = (PrinterCUPS *)data;
+    gint64 start = g_get_monotonic_time();
+
+    if (ensure_printer_connection(p))
+        get_printer_attributes(p);
+    logdebug("Warmed up %s in %ld ms\n", p->name,
+             (long)((g_get_monotonic_time() - start) / 1000));
+
+    /** The dialogs may have dropped the printer meanwhile; if this is the
+     * last reference, free it on the main loop, which owns the string pool
+     * and the printer's tables **/
+    g_main_context_invoke(NULL, unref_printer_cb, p);
+}
+
+void warm_up_printers(BackendObj *b, GHashTable *printers)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (warmup_threads() == 0)
+        return;
+
+    g_hash_table_iter_init(&iter, printers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        PrinterCUPS *p = (PrinterCUPS *)value;
+
+        /** Temporary queues get created by connecting, leave them for when they're used **/
+        if (printer_is_remote(p) || printer_is_temporary(p))
+            continue;
+        if (!g_atomic_int_compare_and_exchange(&p->warmed_up, 0, 1))
+            continue;
+        push_background_task(warm_up_printer, ref_PrinterCUPS(p));
+    }
+}
+
+const char *lookup_default(PrinterCUPS *p, const char *option_name, char *buf, size_t bufsize)
+{
+    /** first take care of special cases**/
+    if (ipp_keyword_flags(option_name) & KW_ORIENTATION)
+        return lookup_orientation_default(p);
+
+    /** Generic cases next **/
+    ipp_attribute_t *def_attr = printer_default(p, option_name);
+    const char *def_value = printer_option(p, option_name);
 
     /** First check the option is already there in p->dest->options **/
     if (def_value)
     {
         if (def_attr && (ippGetValueTag(def_attr) == IPP_TAG_ENUM))
-            return cpdbGetStringCopy(ippEnumString(option_name, atoi(def_value)));
+            return ippEnumString(option_name, atoi(def_value));
 
-        return cpdbGetStringCopy(def_value);
+        return def_value;
     }
     if (def_attr)
     {
-        return extract_ipp_attribute(def_attr, 0, option_name);
+        return format_ipp_value(def_attr, 0, option_name, buf, bufsize);
     }
-    return cpdbGetStringCopy("NA");
+    return "NA";
+}
+
+char *get_default(PrinterCUPS *p, char *option_name)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+    return cpdbGetStringCopy(lookup_default(p, option_name, buf, sizeof(buf)));
 }
 /**************Option************************************/
 Option *get_NA_option()
@@ -710,21 +1711,6 @@ void print_option(const Option *opt)
     }
     printf("****DEFAULT: %s\n", opt->default_value);
 }
-void free_options(int count, Option *opts)
-{
-    int i, j; /**Looping variables */
-    for (i = 0; i < count; i++)
-    {
-        free(opts[i].option_name);
-        for (j = 0; j < opts[i].num_supported; j++)
-        {
-            free(opts[i].supported_values[j]);
-        }
-        free(opts[i].supported_values);
-        free(opts[i].default_value);
-    }
-    free(opts);
-}
 void unpack_option_array(GVariant *var, int num_options, Option **options)
 {
     Option *opt = (Option *)(malloc(sizeof(Option) * num_options));
@@ -757,7 +1743,7 @@ void unpack_option_array(GVariant *var, int num_options, Option **options)
 }
 GVariant *pack_option(const Option *opt)
 {
-    char *group_name = cpdbGetGroup(opt->option_name);
+    const char *group_name = get_option_group(opt->option_name);
     GVariant **t = g_new(GVariant *, 5);
     t[0] = g_variant_new_string(opt->option_name);
     t[1] = g_variant_new_string(group_name);
@@ -766,9 +1752,25 @@ GVariant *pack_option(const Option *opt)
     t[4] = cpdbPackStringArray(opt->num_supported, opt->supported_values);
     GVariant *tuple_variant = g_variant_new_tuple(t, 5);
     g_free(t);
-    free(group_name);
     return tuple_variant;
 }
+GVariant *pack_option_default(const Option *opt)
+{
+    return g_variant_new("(sss)", opt->option_name,
+                         get_option_group(opt->option_name),
+                         opt->default_value);
+}
+
+const Option *find_option(PrinterCapabilities *c, const char *option_name)
+{
+    for (int i = 0; i < c->num_options; i++)
+    {
+        if (strcmp(c->options[i].option_name, option_name) == 0)
+            return &c->options[i];
+    }
+    return NULL;
+}
+
 GVariant *pack_media(const Media *media)
 {
 	GVariant **t = g_new(GVariant *, 5);
@@ -781,8 +1783,178 @@ GVariant *pack_media(const Media *media)
 	g_free(t);
 	return tuple_variant;
 }
-int get_all_options(PrinterCUPS *p, Option **options)
+/**
+ * Replace a draft/normal/high print-quality keyword by its enum value.
+ * These are choices, not options, so they're kept out of the keyword
+ * registry, which option names are looked up in.
+ */
+static char *map_print_quality(char *value)
 {
+    static const char *const keywords[] = {"draft", "normal", "high"};
+    static const char *const values[] = {"3", "4", "5"};
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(keywords); i++)
+    {
+        if (g_ascii_strcasecmp(value, keywords[i]) == 0)
+            return (char *)values[i];
+    }
+    return value;
+}
+
+/**
+ * CUPS specific options which printers don't report themselves
+ */
+typedef struct _StaticOption
+{
+    const char *name;
+    int num_supported;
+    const char *const *supported_values;
+    const char *fallback_default;       /** when there's no default; NULL for the first choice **/
+    const char *(*map_default)(const char *def);    /** turns a default into one of the choices **/
+} StaticOption;
+
+static const char *const off_on[] = {"off", "on"};
+static const char *const booklet_choices[] = {"off", "on", "shuffle-only"};
+static const char *const job_sheets_choices[] = {"none", "classified", "confidential", "form",
+                                                 "secret", "standard", "topsecret", "unclassified"};
+static const char *const multiple_document_handling_choices[] = {"separate-documents-uncollated-copies",
+                                                                 "separate-documents-collated-copies"};
+static const char *const number_up_choices[] = {"1", "2", "4", "6", "9", "16"};
+static const char *const number_up_layout_choices[] = {"lrtb", "lrbt", "rltb", "rlbt",
+                                                       "tblr", "tbrl", "btlr", "btrl"};
+static const char *const orientation_choices[] = {"3", "4", "5", "6"};
+static const char *const page_border_choices[] = {"none", "single", "single-thick",
+                                                  "double", "double-thick"};
+static const char *const page_delivery_choices[] = {"same-order", "reverse-order"};
+static const char *const page_set_choices[] = {"all", "even", "odd"};
+static const char *const position_choices[] = {"center", "top", "bottom", "left", "right",
+                                               "top-left", "top-right", "bottom-left", "bottom-right"};
+static const char *const print_scaling_choices[] = {"auto", "auto-fit", "fill", "fit", "none"};
+
+/** get_default() reports orientation-requested by its keyword **/
+static const char *map_orientation_default(const char *def)
+{
+    if (strcmp(def, "landscape") == 0)
+        return orientation_choices[1];
+    if (strcmp(def, "reverse-landscape") == 0)
+        return orientation_choices[2];
+    if (strcmp(def, "reverse-portrait") == 0)
+        return orientation_choices[3];
+    return orientation_choices[0];
+}
+
+#define STATIC_CHOICES(choices) G_N_ELEMENTS(choices), choices
+
+static const StaticOption static_options[] = {
+    {"booklet", STATIC_CHOICES(booklet_choices), NULL, NULL},
+    {"ipp-attribute-fidelity", STATIC_CHOICES(off_on), NULL, NULL},
+    {"job-sheets", STATIC_CHOICES(job_sheets_choices), "none,none", NULL},
+    {"mirror", STATIC_CHOICES(off_on), NULL, NULL},
+    {"multiple-document-handling", STATIC_CHOICES(multiple_document_handling_choices), NULL, NULL},
+    {"number-up", STATIC_CHOICES(number_up_choices), NULL, NULL},
+    {"number-up-layout", STATIC_CHOICES(number_up_layout_choices), NULL, NULL},
+    {"orientation-requested", STATIC_CHOICES(orientation_choices), NULL, map_orientation_default},
+    {"page-border", STATIC_CHOICES(page_border_choices), NULL, NULL},
+    {"page-delivery", STATIC_CHOICES(page_delivery_choices), NULL, NULL},
+    {"page-set", STATIC_CHOICES(page_set_choices), NULL, NULL},
+    {"position", STATIC_CHOICES(position_choices), NULL, NULL},
+    {"print-scaling", STATIC_CHOICES(print_scaling_choices), NULL, NULL},
+    {"billing-info", 0, NULL, "", NULL},
+};
+
+/**
+ * Fill opt from the descriptor; only the default value of the printer,
+ * if it has one, is copied into the arena
+ */
+static void fill_static_option(PrinterCUPS *p, Arena *a, const StaticOption *desc, Option *opt)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+    const char *def;
+
+    opt->option_name = (char *)desc->name;
+    opt->num_supported = desc->num_supported;
+    opt->supported_values = (char **)desc->supported_values;
+
+    def = lookup_default(p, opt->option_name, buf, sizeof(buf));
+    if (def == NULL)
+        def = "NA";
+    if (strcmp(def, "NA") != 0 && desc->map_default == NULL)
+    {
+        opt->default_value = arena_strdup(a, def);
+        return;
+    }
+
+    if (strcmp(def, "NA") != 0)
+        opt->default_value = (char *)desc->map_default(def);
+    else if (desc->fallback_default)
+        opt->default_value = (char *)desc->fallback_default;
+    else
+        opt->default_value = (char *)desc->supported_values[0];
+}
+
+/** The options add_media_to_options() appends **/
+static const char *const media_options[] = {"media", "media-left-margin", "media-bottom-margin",
+                                            "media-top-margin", "media-right-margin"};
+
+/** Copy the value into the arena, or "NA" if there is none **/
+static char *arena_value(Arena *a, const char *value)
+{
+    return value ? arena_strdup(a, value) : (char *)intern_string("NA");
+}
+
+static int read_options(PrinterCUPS *p, Arena *a, Option **options, gboolean with_choices);
+static int add_media_defaults_to_options(PrinterCUPS *p, Arena *a, Option **options, int count);
+
+int get_all_options(PrinterCUPS *p, Arena *a, Option **options)
+{
+    return read_options(p, a, options, TRUE);
+}
+
+int get_option_defaults(PrinterCUPS *p, Arena *a, Option **options)
+{
+    int count = read_options(p, a, options, FALSE);
+    return add_media_defaults_to_options(p, a, options, count);
+}
+
+/**
+ * Append the options add_media_to_options() adds, with their defaults only
+ */
+static int add_media_defaults_to_options(PrinterCUPS *p, Arena *a, Option **options, int count)
+{
+    int i, n = G_N_ELEMENTS(media_options);
+    ipp_attribute_t *attr;
+    char def[IPP_VALUE_BUFSIZE];
+
+    /** read_options() left room for them **/
+    Option *opts = *options;
+
+    ipp_t *media_col = ippGetCollection(printer_default(p, "media-col"), 0);
+    for (i = 0; i < n; i++)
+    {
+        Option *opt = &opts[count + i];
+        opt->option_name = (char *)media_options[i];
+        if (i == 0)
+        {
+            opt->default_value = arena_value(a, lookup_default(p, opt->option_name, def, sizeof(def)));
+            continue;
+        }
+        attr = ippFindAttribute(media_col, opt->option_name, IPP_TAG_INTEGER);
+        snprintf(def, sizeof(def), "%d", ippGetInteger(attr, 0));
+        opt->default_value = arena_strdup(a, def);
+    }
+
+    return count + n;
+}
+
+/**
+ * Read the options of the printer; without their supported values if
+ * with_choices is FALSE
+ */
+static int read_options(PrinterCUPS *p, Arena *a, Option **options, gboolean with_choices)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+
     ensure_printer_connection(p);
 
     char **option_names;
@@ -800,506 +1972,362 @@ int get_all_options(PrinterCUPS *p, Option **options)
 
     int i, j, optsIndex = 0;                                         /**Looping variables **/
 
-    Option *opts = (Option *)(malloc(sizeof(Option) * (num_options+20))); /**Option array, which will be filled **/
+    Option *opts = (Option *)arena_alloc(a, sizeof(Option) * (num_options + G_N_ELEMENTS(static_options) +
+                                                              G_N_ELEMENTS(media_options))); /**Option array, which will be filled **/
     ipp_attribute_t *vals;                                                /** Variable to store the values of the options **/
     
 
     for (i = 0; i < num_options; i++)
     {
         // Hardcode CUPS specific option
-        if(
-            (strcmp(option_names[i], "booklet") == 0) ||
-            (strcmp(option_names[i], "ipp-attribute-fidelity") == 0) ||
-            (strcmp(option_names[i], "job-sheets") == 0) ||
-            (strcmp(option_names[i], "media") == 0) ||
-            (strcmp(option_names[i], "media-col") == 0) ||
-            (strcmp(option_names[i], "mirror") == 0) ||
-            (strcmp(option_names[i], "multiple-document-handling") == 0) ||
-            (strcmp(option_names[i], "number-up") == 0) ||
-            (strcmp(option_names[i], "number-up-layout") == 0) ||
-            (strcmp(option_names[i], "orientation-requested") == 0) ||
-            (strcmp(option_names[i], "page-border") == 0) ||
-            (strcmp(option_names[i], "page-delivery") == 0) ||
-            (strcmp(option_names[i], "page-set") == 0) ||
-            (strcmp(option_names[i], "position") == 0) ||
-            (strcmp(option_names[i], "print-scaling") == 0)
-        )
+        if (ipp_keyword_flags(option_names[i]) & KW_HARDCODED)
+        {
+            free(option_names[i]);
             continue;
+        }
 
-        opts[optsIndex].option_name = option_names[i];
-        vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, option_names[i]);
+        /** The option keywords are the same for every printer **/
+        opts[optsIndex].option_name = (char *)intern_string(option_names[i]);
+        free(option_names[i]);
+        option_names[i] = opts[optsIndex].option_name;
+        vals = NULL;
+        if (with_choices)
+            vals = printer_supported(p, option_names[i]);
         if (vals)
             opts[optsIndex].num_supported = ippGetCount(vals);
         else
             opts[optsIndex].num_supported = 0;
 
         /** Retreive all the supported values for that option **/
-        opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
+        opts[optsIndex].supported_values = arena_alloc(a, sizeof(char *) * opts[optsIndex].num_supported);
         for (j = 0; j < opts[optsIndex].num_supported; j++)
         {
-            opts[optsIndex].supported_values[j] = extract_ipp_attribute(vals, j, option_names[i]);
-            if (opts[optsIndex].supported_values[j] == NULL)
-            {
-                opts[optsIndex].supported_values[j] = cpdbGetStringCopy("NA");
-            }
+            opts[optsIndex].supported_values[j] =
+                arena_value(a, format_ipp_value(vals, j, option_names[i], buf, sizeof(buf)));
         }
 
         /** Retrieve the default value for that option **/
-        opts[optsIndex].default_value = get_default(p, option_names[i]);
-        if (opts[optsIndex].default_value == NULL)
+        opts[optsIndex].default_value = arena_value(a, lookup_default(p, option_names[i], buf, sizeof(buf)));
+
+        /** Printers report print-quality by keyword, but it is sent as enum **/
+        if (ipp_keyword_flags(option_names[i]) & KW_PRINT_QUALITY_OPTION)
         {
-            opts[optsIndex].default_value = cpdbGetStringCopy("NA");
+            for (j = 0; j < opts[optsIndex].num_supported; j++)
+                opts[optsIndex].supported_values[j] = map_print_quality(opts[optsIndex].supported_values[j]);
+            opts[optsIndex].default_value = map_print_quality(opts[optsIndex].default_value);
         }
 
         optsIndex++;
     }
 
-    /* Add the booklet option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("booklet");
-    opts[optsIndex].num_supported = 3;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("off");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("on");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("shuffle-only");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the ipp-attribute-fidelity option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("ipp-attribute-fidelity");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("off");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("on");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the job-sheets option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("job-sheets");
-    opts[optsIndex].num_supported = 8;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("none");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("classified");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("confidential");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("form");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("secret");
-    opts[optsIndex].supported_values[5] = cpdbGetStringCopy("standard");
-    opts[optsIndex].supported_values[6] = cpdbGetStringCopy("topsecret");
-    opts[optsIndex].supported_values[7] = cpdbGetStringCopy("unclassified");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy("none,none");
-    }
-    optsIndex++;
-
-    /* Add the mirror option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("mirror");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("off");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("on");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the multiple-document-handling option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("multiple-document-handling");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("separate-documents-uncollated-copies");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("separate-documents-collated-copies");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the number-up option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("number-up");
-    opts[optsIndex].num_supported = 6;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("1");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("2");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("4");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("6");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("9");
-    opts[optsIndex].supported_values[5] = cpdbGetStringCopy("16");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the number-up-layout option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("number-up-layout");
-    opts[optsIndex].num_supported = 8;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("lrtb");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("lrbt");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("rltb");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("rlbt");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("tblr");
-    opts[optsIndex].supported_values[5] = cpdbGetStringCopy("tbrl");
-    opts[optsIndex].supported_values[6] = cpdbGetStringCopy("btlr");
-    opts[optsIndex].supported_values[7] = cpdbGetStringCopy("btrl");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the orientation-requested option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("orientation-requested");
-    opts[optsIndex].num_supported = 4;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("3");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("4");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("5");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("6");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
+    /* Add the CUPS specific options */
+    for (i = 0; i < G_N_ELEMENTS(static_options); i++)
+    {
+        fill_static_option(p, a, &static_options[i], &opts[optsIndex]);
+        if (!with_choices)
+            opts[optsIndex].num_supported = 0;
+        optsIndex++;
     }
-    else
+
+    free(option_names);
+    *options = opts;
+    return optsIndex;
+}
+
+/**
+ * pwgMediaForSize() searches the PWG size table linearly and the printers
+ * all report the same few sizes, so its answers are kept for good and
+ * shared between printers. It matches within a tolerance, so several
+ * reported dimensions can name the same size; there is one PwgSize per
+ * name, so that equal pointers mean equal names.
+ */
+typedef struct _PwgSize
+{
+    char *name;
+    int width;
+    int length;
+} PwgSize;
+
+static GMutex pwg_sizes_lock;
+static GHashTable *pwg_sizes = NULL;        /** width << 32 | length, as reported **/
+static GHashTable *pwg_sizes_by_name = NULL;
+
+static const PwgSize *lookup_pwg_size(int width, int length)
+{
+    gint64 key = ((gint64)width << 32) | (guint32)length;
+    gint64 *key_copy;
+    pwg_media_t *pwg_media;
+    PwgSize *size;
+
+    g_mutex_lock(&pwg_sizes_lock);
+    if (pwg_sizes == NULL)
     {
-        if (strcmp(opts[optsIndex].default_value, "potrait") == 0)
-            opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-        else if (strcmp(opts[optsIndex].default_value, "landscape") == 0)
-            opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[1]);
-        else if (strcmp(opts[optsIndex].default_value, "reverse-landscape") == 0)
-            opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[2]);
-        else if (strcmp(opts[optsIndex].default_value, "reverse-potrait") == 0)
-            opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[3]);
-        else
-            opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-border option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("page-border");
-    opts[optsIndex].num_supported = 5;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("none");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("single");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("single-thick");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("double");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("double-thick");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-delivery option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("page-delivery");
-    opts[optsIndex].num_supported = 2;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("same-order");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("reverse-order");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the page-set option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("page-set");
-    opts[optsIndex].num_supported = 3;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("all");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("even");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("odd");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the position option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("position");
-    opts[optsIndex].num_supported = 9;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("center");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("top");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("bottom");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("left");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("right");
-    opts[optsIndex].supported_values[5] = cpdbGetStringCopy("top-left");
-    opts[optsIndex].supported_values[6] = cpdbGetStringCopy("top-right");
-    opts[optsIndex].supported_values[7] = cpdbGetStringCopy("bottom-left");
-    opts[optsIndex].supported_values[8] = cpdbGetStringCopy("bottom-right");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the print-scaling option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("print-scaling");
-    opts[optsIndex].num_supported = 5;
-    opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
-    opts[optsIndex].supported_values[0] = cpdbGetStringCopy("auto");
-    opts[optsIndex].supported_values[1] = cpdbGetStringCopy("auto-fit");
-    opts[optsIndex].supported_values[2] = cpdbGetStringCopy("fill");
-    opts[optsIndex].supported_values[3] = cpdbGetStringCopy("fit");
-    opts[optsIndex].supported_values[4] = cpdbGetStringCopy("none");
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy(opts[optsIndex].supported_values[0]);
-    }
-    optsIndex++;
-
-    /* Add the billing-info option */
-    opts[optsIndex].option_name = cpdbGetStringCopy("billing-info");
-    opts[optsIndex].num_supported = 0;
-    opts[optsIndex].supported_values = NULL;
-    opts[optsIndex].default_value = get_default(p, opts[optsIndex].option_name);
-    if (strcmp(opts[optsIndex].default_value, "NA") == 0)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy("");
-    }
-    optsIndex++;
-
-    /* Correct the print-quality option */
-    for (i = 0; i < optsIndex; i++)
-    {
-        if (strcmp(opts[i].option_name, "print-quality") == 0)
+        pwg_sizes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+        pwg_sizes_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    size = g_hash_table_lookup(pwg_sizes, &key);
+    if (size == NULL && (pwg_media = pwgMediaForSize(width, length)) != NULL)
+    {
+        size = g_hash_table_lookup(pwg_sizes_by_name, pwg_media->pwg);
+        if (size == NULL)
         {
-            for (j = 0; j < opts[i].num_supported; j++)
-            {
-                if (strcasecmp(opts[i].supported_values[j], "draft") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = cpdbGetStringCopy("3");
-                    continue;
-                }
-                if (strcasecmp(opts[i].supported_values[j], "normal") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = cpdbGetStringCopy("4");
-                    continue;
-                }
-                if (strcasecmp(opts[i].supported_values[j], "high") == 0)
-                {
-                    free(opts[i].supported_values[j]);
-                    opts[i].supported_values[j] = cpdbGetStringCopy("5");
-                    continue;
-                }
-            }
+            size = g_new(PwgSize, 1);
+            size->name = cpdbGetStringCopy(pwg_media->pwg);
+            size->width = pwg_media->width;
+            size->length = pwg_media->length;
+            g_hash_table_insert(pwg_sizes_by_name, size->name, size);
+        }
+        key_copy = g_new(gint64, 1);
+        *key_copy = key;
+        g_hash_table_insert(pwg_sizes, key_copy, size);
+    }
+    g_mutex_unlock(&pwg_sizes_lock);
 
-            if (strcasecmp(opts[i].default_value, "draft") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = cpdbGetStringCopy("3");
-                continue;
-            }
-            if (strcasecmp(opts[i].default_value, "normal") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = cpdbGetStringCopy("4");
-                continue;
-            }
-            if (strcasecmp(opts[i].default_value, "high") == 0)
-            {
-                free(opts[i].default_value);
-                opts[i].default_value = cpdbGetStringCopy("5");
-                continue;
-            }
+    return size;
+}
 
-            break;
+/** A single media-col-database or media-col-ready entry **/
+typedef struct _MediaEntry
+{
+    const PwgSize *size;
+    int has_margins;    /** media-ready entries don't say **/
+    int margins[4];     /** left, right, top, bottom like Media **/
+} MediaEntry;
+
+/** By size name, then by margins, so that duplicates end up next to each other **/
+static int compare_media_entries(const void *a, const void *b)
+{
+    const MediaEntry *x = (const MediaEntry *)a, *y = (const MediaEntry *)b;
+    int cmp;
+
+    if (x->size != y->size && (cmp = strcmp(x->size->name, y->size->name)) != 0)
+        return cmp;
+    if (x->has_margins != y->has_margins)
+        return x->has_margins - y->has_margins;
+    return memcmp(x->margins, y->margins, sizeof(x->margins));
+}
+
+static int read_margin(ipp_t *tuple, const char *name)
+{
+    return ippGetInteger(ippFindAttribute(tuple, name, IPP_TAG_INTEGER), 0);
+}
+
+/**
+ * Group the entries by size. They are sorted first, so that each size and
+ * its distinct margins come in one run, and the result is laid out in one
+ * block: the MediaDatabase, its Media array, and all the margins, each
+ * size's margins next to each other. Entries without margins only add
+ * their size, so that it isn't taken for a borderless one.
+ */
+static MediaDatabase *group_media_entries(MediaEntry *entries, int n)
+{
+    int i, num_media = 0, num_margins = 0;
+    MediaEntry *e;
+    MediaDatabase *db;
+    Media *media = NULL;
+    int (*margins)[4];
+
+    qsort(entries, n, sizeof(MediaEntry), compare_media_entries);
+
+    for (i = 0; i < n; i++)
+    {
+        if (i == 0 || entries[i].size->name != entries[i - 1].size->name)
+            num_media++;
+        if (entries[i].has_margins &&
+            (i == 0 || compare_media_entries(&entries[i], &entries[i - 1]) != 0))
+            num_margins++;
+    }
+
+    db = malloc(sizeof(MediaDatabase) + sizeof(Media) * num_media + sizeof(int) * 4 * num_margins);
+    db->ref_count = 1;
+    db->num_media = num_media;
+    db->media = (Media *)(db + 1);
+    margins = (int (*)[4])(db->media + num_media);
+
+    for (i = 0; i < n; i++)
+    {
+        e = &entries[i];
+        if (i == 0 || e->size->name != entries[i - 1].size->name)
+        {
+            media = media ? media + 1 : db->media;
+            media->name = (char *)e->size->name;
+            media->width = e->size->width;
+            media->length = e->size->length;
+            media->num_margins = 0;
+            media->margins = margins;
         }
+        else if (compare_media_entries(e, &entries[i - 1]) == 0)
+        {
+            continue;
+        }
+        if (!e->has_margins)
+            continue;
+        memcpy(media->margins[media->num_margins++], e->margins, sizeof(e->margins));
+        margins++;
     }
 
-    *options = (Option *) realloc(opts, sizeof(Option) * optsIndex);
-    return optsIndex;
+    return db;
 }
-int get_all_media(PrinterCUPS *p, Media **medias)
-{	
-	ensure_printer_connection(p);
-	ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-	const char *uri = cupsGetOption("printer-uri-supported", 
-									p->dest->num_options,
-									p->dest->options);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                 "printer-uri", NULL, uri);
-    const char *const requested_attributes[] = {"media-col-database"};
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                  "requested-attributes", 1, NULL,
-                  requested_attributes);
 
-    ipp_t *response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+/**
+ * Decode media-col-database or media-col-ready
+ */
+static MediaDatabase *decode_media_col(ipp_attribute_t *mdb)
+{
+    int count = ippGetCount(mdb);
+    int i, n = 0;
+    int width, length;
+    MediaEntry *entries, *e;
+    MediaDatabase *db;
+    ipp_t *tuple, *media_size;
+
+    entries = g_new(MediaEntry, count ? count : 1);
+    for (i = 0; i < count; i++)
     {
-        /* request failed */
-        printf("Request failed: %s\n", cupsLastErrorString());
-        return 0;
+        tuple = ippGetCollection(mdb, i);
+        media_size = ippGetCollection(ippFindAttribute(tuple, "media-size", IPP_TAG_BEGIN_COLLECTION), 0);
+        width = ippGetInteger(ippFindAttribute(media_size, "x-dimension", IPP_TAG_INTEGER), 0);
+        length = ippGetInteger(ippFindAttribute(media_size, "y-dimension", IPP_TAG_INTEGER), 0);
+        if (width <= 0 || length <= 0)
+            continue;
+
+        e = &entries[n];
+        if ((e->size = lookup_pwg_size(width, length)) == NULL)
+            continue;
+        e->has_margins = 1;
+        e->margins[0] = read_margin(tuple, "media-left-margin");
+        e->margins[1] = read_margin(tuple, "media-right-margin");
+        e->margins[2] = read_margin(tuple, "media-top-margin");
+        e->margins[3] = read_margin(tuple, "media-bottom-margin");
+        n++;
     }
-    
-    int media_num = 0;				/** Number of unqiue media sizes **/
-    Media *meds = NULL;				/** Array of unique media sizes **/
 
-    ipp_attribute_t *mdb; // media database
-    if ((mdb = ippFindAttribute(response, "media-col-database", IPP_TAG_BEGIN_COLLECTION)) != NULL)
+    db = group_media_entries(entries, n);
+    g_free(entries);
+    return db;
+}
+
+/**
+ * media-ready only names the sizes, so they come without margins; the
+ * margins are only known once the full database is read
+ */
+static MediaDatabase *decode_media_ready(ipp_attribute_t *ready)
+{
+    int count = ippGetCount(ready);
+    int i, n = 0;
+    pwg_media_t *pwg_media;
+    MediaEntry *entries, *e;
+    MediaDatabase *db;
+
+    entries = g_new0(MediaEntry, count ? count : 1);
+    for (i = 0; i < count; i++)
     {
-		int i, j;
-		gpointer key, value;		/** Looping variables **/
-		
-        const char *name;			/** PWG name for a media **/
-		int width, length;			/** Width and length of a media **/
-		pwg_media_t *pwg_media;
-		
-		ipp_t *tuple; 				/** Single media entry in media-col-database **/
-		ipp_t *media_size;			/** media-size collection in a media tuple **/ 
-		ipp_attribute_t *attr;		/** Temporary variable for ipp attributes in a single tuple **/
-		
-		typedef struct Margin {
-			int left;
-			int right;
-			int top;
-			int bottom;
-		} Margin;
-        
-        Margin *margin;				/** Single margin struct for some media size**/
-		GList *margins, *listIter;	/** List of all different margins for some media size **/
-		GHashTable *table;			/** [media-size]-->[margins] **/
-		GHashTableIter iter;		/** For iterating over the table **/
-		
-		table = g_hash_table_new(g_str_hash, g_str_equal);
-		
-		int count = ippGetCount(mdb);
-		for (int i = 0; i < count; i++)
-		{
-			tuple = ippGetCollection(mdb, i);
-			
-			attr = ippFindAttribute(tuple, "media-size", IPP_TAG_BEGIN_COLLECTION);
-			media_size = ippGetCollection(attr, 0);
-			attr = ippFindAttribute(media_size, "x-dimension", IPP_TAG_INTEGER);
-			width = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(media_size, "y-dimension", IPP_TAG_INTEGER);
-			length = ippGetInteger(attr, 0);
-
-			if (width <= 0 || length <= 0)
-			  continue;
-
-			pwg_media = pwgMediaForSize(width, length);
-			name = pwg_media->pwg;
-
-			margin = g_new0(Margin, 1);
-
-			attr = ippFindAttribute(tuple, "media-left-margin", IPP_TAG_INTEGER);
-			margin->left = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-right-margin", IPP_TAG_INTEGER);
-			margin->right = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-top-margin", IPP_TAG_INTEGER);
-			margin->top = ippGetInteger(attr, 0);
-			attr = ippFindAttribute(tuple, "media-bottom-margin", IPP_TAG_INTEGER);
-			margin->bottom = ippGetInteger(attr, 0);
-			
-			margins = g_hash_table_lookup(table, name);
-			margins = g_list_prepend(margins, margin);
-			g_hash_table_replace(table, (gpointer) name, margins);
-		}
-		
-		media_num = g_hash_table_size(table);
-        meds = g_new0 (Media, media_num);
-		
-		i = 0;
-		g_hash_table_iter_init(&iter, table);
-		while (g_hash_table_iter_next(&iter, &key, &value))
-		{
-            name = (char *) key;
-            pwg_media = pwgMediaForPWG(name);
-
-			margins = (GList *) value;
-            margins = g_list_reverse(margins);
-            
-            meds[i].name = cpdbGetStringCopy(name);
-            meds[i].width = pwg_media->width;
-            meds[i].length = pwg_media->length;
-            meds[i].num_margins = g_list_length(margins);
-            meds[i].margins = malloc(sizeof(int) * meds[i].num_margins * 4);
-            
-            j = 0;
-            listIter = margins;
-            while (listIter != NULL)
-            {
-				margin = (Margin *) listIter->data;
-				
-				meds[i].margins[j][0] = margin->left;
-				meds[i].margins[j][1] = margin->right;
-				meds[i].margins[j][2] = margin->top;
-				meds[i].margins[j][3] = margin->bottom;
-
-				free(margin);
-
-				listIter = listIter->next;
-				j++;
-			}
-			g_list_free(margins);
-			i++;
-		}
+        pwg_media = pwgMediaForPWG(ippGetString(ready, i, NULL));
+        if (pwg_media == NULL || pwg_media->width <= 0 || pwg_media->length <= 0)
+            continue;
+
+        e = &entries[n];
+        if ((e->size = lookup_pwg_size(pwg_media->width, pwg_media->length)) == NULL)
+            continue;
+        n++;
+    }
+
+    db = group_media_entries(entries, n);
+    g_free(entries);
+    return db;
+}
+
+MediaDatabase *get_media_database(PrinterCUPS *p)
+{
+    static const char *const media_col_database[] = {"media-col-database"};
+    MediaDatabase *db = NULL;
+    ipp_t *response;
+
+    g_rec_mutex_lock(&p->lock);
+    /** It can be huge, so it isn't among the printer_attributes **/
+    if (p->media_db == NULL &&
+        (response = request_printer_attributes(p, 1, media_col_database)) != NULL)
+    {
+        p->media_db = decode_media_col(
+            ippFindAttribute(response, "media-col-database", IPP_TAG_BEGIN_COLLECTION));
+        logdebug("Decoded %d media sizes of %s\n", p->media_db->num_media, p->name);
+        ippDelete(response);
+    }
+    if (p->media_db)
+        db = ref_MediaDatabase(p->media_db);
+    g_rec_mutex_unlock(&p->lock);
+
+    return db;
+}
+
+MediaDatabase *get_ready_media(PrinterCUPS *p)
+{
+    ipp_t *response;
+    ipp_attribute_t *attr;
+    MediaDatabase *db = NULL;
 
-		g_hash_table_destroy(table);
-	}
-	
-	ippDelete(response);
-	
-	*medias = meds;
-	return media_num;
+    g_rec_mutex_lock(&p->lock);
+    if ((response = get_printer_attributes(p)) == NULL)
+    {
+        g_rec_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    if ((attr = ippFindAttribute(response, "media-col-ready", IPP_TAG_BEGIN_COLLECTION)) != NULL)
+        db = decode_media_col(attr);
+    else if ((attr = ippFindAttribute(response, "media-ready", IPP_TAG_ZERO)) != NULL)
+        db = decode_media_ready(attr);
+    g_rec_mutex_unlock(&p->lock);
+
+    if (db && db->num_media == 0)
+    {
+        unref_MediaDatabase(db);
+        db = NULL;
+    }
+    return db;
+}
+
+MediaDatabase *ref_MediaDatabase(MediaDatabase *db)
+{
+    g_atomic_int_inc(&db->ref_count);
+    return db;
+}
+
+void unref_MediaDatabase(MediaDatabase *db)
+{
+    if (db && g_atomic_int_dec_and_test(&db->ref_count))
+        free(db);
 }
-int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option **options, int count)
+int add_media_to_options(PrinterCUPS *p, Arena *a, Media *medias, int media_count,
+                         gboolean custom_sizes, Option **options, int count)
 {
     int i, j;							/** Looping variables **/
     int num_media;						/** Variable for number of "media" supported using CUPS call **/
-    char *media_name;					/** Variable for media name **/
+    const char *media_name;				/** Variable for media name **/
+    char buf[IPP_VALUE_BUFSIZE];
     int width, length;					/** Variable for media width and media length **/
     int optsIndex = count;				/** Index for fillings options **/
     pwg_media_t *pwg_media;	
     ipp_t *media_col, *media_size;		/** media_col and media_size collections in IPP request **/
     ipp_attribute_t *vals, *default_val, *attr;
 
-    count += 5;	/** "media", "media-{top, bottom, left, right}-margins" **/
-    Option *opts = *options;
-    
-    opts = realloc(opts, sizeof(Option) * count);
+    count += G_N_ELEMENTS(media_options);	/** "media", "media-{top, bottom, left, right}-margins" **/
+    Option *opts = *options;	/** get_all_options() left room for them **/
     
      /* Add the media option */
-	opts[optsIndex].option_name = cpdbGetStringCopy("media");
+	opts[optsIndex].option_name = (char *)intern_string("media");
 	opts[optsIndex].num_supported = media_count;
-	opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported + 2);	/** 2 extra for custom_min and custom_max sizes **/
+	opts[optsIndex].supported_values = arena_alloc(a, sizeof(char *) * (opts[optsIndex].num_supported + 2));	/** 2 extra for custom_min and custom_max sizes **/
 	for (i = 0; i < opts[optsIndex].num_supported; i++)
     {
-		opts[optsIndex].supported_values[i] = cpdbGetStringCopy(medias[i].name);
+		opts[optsIndex].supported_values[i] = arena_strdup(a, medias[i].name);
     }
 
-    opts[optsIndex].default_value = get_default(p, "media");
-    if (opts[optsIndex].default_value == NULL)
-    {
-        opts[optsIndex].default_value = cpdbGetStringCopy("NA");
-    }
+    opts[optsIndex].default_value = arena_value(a, lookup_default(p, "media", buf, sizeof(buf)));
     
     /** Add custom_min and custom_max media if they exist **/
-    vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, "media");
+    vals = custom_sizes ? printer_supported(p, "media") : NULL;
     if (vals)
 		num_media = ippGetCount(vals);
 	else
@@ -1307,18 +2335,16 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
 	
 	for (j = 0; j < num_media && i < (media_count + 2); j++)
 	{
-		media_name = extract_ipp_attribute(vals, i, "media");
+		media_name = format_ipp_value(vals, j, "media", buf, sizeof(buf));
 		
 		if (media_name == NULL)
 			continue;
 		
 		if (strncmp(media_name, "custom_min", 10) == 0 || strncmp(media_name, "custom_max", 10) == 0)
 		{
-			opts[optsIndex].supported_values[i] = cpdbGetStringCopy(media_name);
+			opts[optsIndex].supported_values[i] = arena_strdup(a, media_name);
 			i++;
 		}
-		
-		free(media_name);
 	}
 	opts[optsIndex].num_supported = media_count = i;
 	
@@ -1328,84 +2354,835 @@ int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option
     char def[16];
     char *attrs[] = {"media-left-margin", "media-bottom-margin", "media-top-margin", "media-right-margin"};
 
-    default_val = cupsFindDestDefault(p->http, p->dest, p->dinfo, "media-col");
+    default_val = printer_default(p, "media-col");
     
     for (i = 0; i < 4; i++) // for each attr in attrs
     {
-        vals = cupsFindDestSupported(p->http, p->dest, p->dinfo, attrs[i]);
-        opts[optsIndex].option_name = cpdbGetStringCopy(attrs[i]);
+        vals = printer_supported(p, attrs[i]);
+        opts[optsIndex].option_name = (char *)intern_string(attrs[i]);
         if (vals)
             opts[optsIndex].num_supported = ippGetCount(vals);
         else
             opts[optsIndex].num_supported = 0;
 
-        opts[optsIndex].supported_values = cpdbNewCStringArray(opts[optsIndex].num_supported);
+        opts[optsIndex].supported_values = arena_alloc(a, sizeof(char *) * opts[optsIndex].num_supported);
         for (j = 0; j < opts[optsIndex].num_supported; j++)
         {
-            opts[optsIndex].supported_values[j] = extract_ipp_attribute(vals, j, attrs[i]);
-            if (opts[optsIndex].supported_values[j] == NULL)
-            {
-                opts[optsIndex].supported_values[j] = cpdbGetStringCopy("NA");
-            }
+            opts[optsIndex].supported_values[j] =
+                arena_value(a, format_ipp_value(vals, j, attrs[i], buf, sizeof(buf)));
         }
 
         media_col = ippGetCollection(default_val, 0);
         attr = ippFindAttribute(media_col, attrs[i], IPP_TAG_INTEGER);
         snprintf(def, 16, "%d", ippGetInteger(attr, 0));
 
-        opts[optsIndex].default_value = cpdbGetStringCopy(def);
-        if (opts[optsIndex].default_value == NULL)
-        {
-            opts[optsIndex].default_value = cpdbGetStringCopy("NA");
-        }
+        opts[optsIndex].default_value = arena_strdup(a, def);
+
+        optsIndex++;
+    }
+
+    *options = opts;
+    return count;
+}
+
+/** Whether the printer takes the option; static and media options aside **/
+static gboolean printer_has_option(PrinterCUPS *p, const char *option_name)
+{
+    char **names;
+    int i, n;
+    gboolean found = FALSE;
+
+    if (strcmp(option_name, "media-source") == 0 || strcmp(option_name, "media-type") == 0)
+        return TRUE;
+
+    n = get_job_creation_attributes(p, &names);
+    for (i = 0; i < n; i++)
+    {
+        found = found || strcmp(names[i], option_name) == 0;
+        free(names[i]);
+    }
+    free(names);
+    return found;
+}
+
+int get_option_choices(PrinterCUPS *p, Arena *a, const char *option_name, char ***choices)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+    ipp_attribute_t *vals;
+    MediaDatabase *db;
+    const char *value;
+    int i, j, count;
+
+    for (i = 0; i < G_N_ELEMENTS(static_options); i++)
+    {
+        if (strcmp(static_options[i].name, option_name) == 0)
+        {
+            *choices = (char **)static_options[i].supported_values;
+            return static_options[i].num_supported;
+        }
+    }
+
+    ensure_printer_connection(p);
+
+    /** The sizes of the media database, and the custom size range **/
+    if (strcmp(option_name, "media") == 0)
+    {
+        db = get_media_database(p);
+        vals = printer_supported(p, "media");
+        count = db ? db->num_media : 0;
+        *choices = arena_alloc(a, sizeof(char *) * (count + 2));
+        for (i = 0; i < count; i++)
+            (*choices)[i] = arena_strdup(a, db->media[i].name);
+        unref_MediaDatabase(db);
+
+        for (j = 0; vals && j < ippGetCount(vals) && i < count + 2; j++)
+        {
+            value = format_ipp_value(vals, j, "media", buf, sizeof(buf));
+            if (value && (strncmp(value, "custom_min", 10) == 0 || strncmp(value, "custom_max", 10) == 0))
+                (*choices)[i++] = arena_strdup(a, value);
+        }
+        return i;
+    }
+
+    for (i = 1; i < G_N_ELEMENTS(media_options); i++)
+    {
+        if (strcmp(media_options[i], option_name) == 0)
+            break;
+    }
+    if (i == G_N_ELEMENTS(media_options) &&
+        ((ipp_keyword_flags(option_name) & KW_HARDCODED) || !printer_has_option(p, option_name)))
+        return -1;
+
+    vals = printer_supported(p, option_name);
+    count = vals ? ippGetCount(vals) : 0;
+    *choices = arena_alloc(a, sizeof(char *) * count);
+    for (j = 0; j < count; j++)
+    {
+        (*choices)[j] = arena_value(a, format_ipp_value(vals, j, option_name, buf, sizeof(buf)));
+        if (ipp_keyword_flags(option_name) & KW_PRINT_QUALITY_OPTION)
+            (*choices)[j] = map_print_quality((*choices)[j]);
+    }
+    return count;
+}
+
+/***************PrinterCapabilities*************************/
+/** Orders storing the cache files against removing them on invalidation **/
+static GMutex capabilities_lock;
+
+static const char *printer_uri(PrinterCUPS *p)
+{
+    const char *uri = printer_option(p, "printer-uri-supported");
+    return uri ? uri : p->name;
+}
+
+/**
+ * printer-config-change-time from the printer attributes, asked for again
+ * once it's PRINTER_STATE_TTL_SEC old, so that options cached in memory or
+ * on disk are checked against the current one; NULL if unknown
+ */
+static const char *config_change_time(PrinterCUPS *p, char *buf, size_t bufsize)
+{
+    ipp_attribute_t *attr;
+    ipp_t *response;
+    const char *val = NULL;
+
+    g_rec_mutex_lock(&p->lock);
+    if ((response = get_printer_attributes(p)) != NULL)
+        refresh_printer_status(p);
+    if (response &&
+        (attr = ippFindAttribute(p->attrs, "printer-config-change-time", IPP_TAG_INTEGER)) != NULL)
+    {
+        snprintf(buf, bufsize, "%d", ippGetInteger(attr, 0));
+        val = buf;
+    }
+    g_rec_mutex_unlock(&p->lock);
+    return val;
+}
+
+static PrinterCapabilities *new_PrinterCapabilities()
+{
+    PrinterCapabilities *c = g_new0(PrinterCapabilities, 1);
+    c->ref_count = 1;
+    c->translations = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            (GDestroyNotify)free_string,
+                                            (GDestroyNotify)g_variant_unref);
+    return c;
+}
+
+GVariant *get_options_reply(PrinterCapabilities *c)
+{
+    GVariantBuilder builder;
+
+    if (c->options_reply == NULL)
+    {
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sssia(s))"));
+        for (int i = 0; i < c->num_options; i++)
+            g_variant_builder_add_value(&builder, pack_option(&c->options[i]));
+        c->options_reply = g_variant_ref_sink(g_variant_builder_end(&builder));
+    }
+    return c->options_reply;
+}
+
+GVariant *get_media_reply(PrinterCapabilities *c)
+{
+    GVariantBuilder builder;
+
+    if (c->media_reply == NULL)
+    {
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a(siiia(iiii))"));
+        for (int i = 0; i < c->num_media; i++)
+            g_variant_builder_add_value(&builder, pack_media(&c->media[i]));
+        c->media_reply = g_variant_ref_sink(g_variant_builder_end(&builder));
+    }
+    return c->media_reply;
+}
+
+PrinterCapabilities *ref_PrinterCapabilities(PrinterCapabilities *c)
+{
+    g_atomic_int_inc(&c->ref_count);
+    return c;
+}
+
+void unref_PrinterCapabilities(PrinterCapabilities *c)
+{
+    if (c == NULL || !g_atomic_int_dec_and_test(&c->ref_count))
+        return;
+
+    free(c->uri);
+    free(c->printer_name);
+    free(c->config_change_time);
+    if (c->options_reply)
+        g_variant_unref(c->options_reply);
+    if (c->media_reply)
+        g_variant_unref(c->media_reply);
+    g_hash_table_destroy(c->translations);
+    if (c->serialized)
+    {
+        /** The strings and margins live in the mapped cache file **/
+        for (int i = 0; i < c->num_options; i++)
+            g_free(c->options[i].supported_values);
+        g_variant_unref(c->serialized);
+    }
+    arena_free(c->arena);
+    unref_MediaDatabase(c->media_db);
+    free(c);
+}
+
+/**
+ * The capabilities are also kept on disk, one file per printer URI, so
+ * that the first dialog after the backend is started doesn't have to
+ * wait for the printers. The files are GVariants in native byte order:
+ * (version, printer-uri, printer-config-change-time,
+ *  [(option, default, [choices])], [(media, width, length, [margins])])
+ */
+#define CAPS_CACHE_VERSION 1
+#define CAPS_CACHE_FORMAT "(ussa(ssas)a(siia(iiii)))"
+
+static char *capabilities_cache_path(const char *uri)
+{
+    char *digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, uri, -1);
+    char *file = g_strconcat(digest, ".caps", NULL);
+    char *path = g_build_filename(g_get_user_cache_dir(), "cpdb", "backend-cups",
+                                  "capabilities", file, NULL);
+    g_free(digest);
+    g_free(file);
+    return path;
+}
+
+static void store_capabilities_on_disk(PrinterCapabilities *c)
+{
+    GVariantBuilder options, media;
+    GVariant *v;
+    GError *error = NULL;
+    int i;
+
+    g_variant_builder_init(&options, G_VARIANT_TYPE("a(ssas)"));
+    for (i = 0; i < c->num_options; i++)
+    {
+        Option *opt = &c->options[i];
+        g_variant_builder_add(&options, "(ss@as)", opt->option_name, opt->default_value,
+                              g_variant_new_strv((const gchar *const *)opt->supported_values,
+                                                 opt->num_supported));
+    }
+
+    g_variant_builder_init(&media, G_VARIANT_TYPE("a(siia(iiii))"));
+    for (i = 0; i < c->num_media; i++)
+    {
+        Media *m = &c->media[i];
+        g_variant_builder_add(&media, "(sii@a(iiii))", m->name, m->width, m->length,
+                              g_variant_new_fixed_array(G_VARIANT_TYPE("(iiii)"), m->margins,
+                                                        m->num_margins, sizeof(int) * 4));
+    }
+
+    v = g_variant_ref_sink(g_variant_new("(uss@a(ssas)@a(siia(iiii)))",
+                                         CAPS_CACHE_VERSION, c->uri,
+                                         c->config_change_time ? c->config_change_time : "",
+                                         g_variant_builder_end(&options),
+                                         g_variant_builder_end(&media)));
+
+    char *path = capabilities_cache_path(c->uri);
+    char *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0700) != 0 ||
+        !g_file_set_contents(path, g_variant_get_data(v), g_variant_get_size(v), &error))
+    {
+        logwarn("Unable to cache the options of %s in %s: %s\n", c->uri, path,
+                error ? error->message : "can't create directory");
+        g_clear_error(&error);
+    }
+    g_free(dir);
+    g_free(path);
+    g_variant_unref(v);
+}
+
+/**
+ * Map the cached capabilities of the printer from disk, if they were read
+ * at the given printer-config-change-time (any time if NULL).
+ * The strings and margins of the result point into the mapped file.
+ */
+static PrinterCapabilities *load_capabilities_from_disk(const char *uri, const char *change_time)
+{
+    GMappedFile *file;
+    GBytes *bytes;
+    GVariant *v, *options, *media, *child, *margins;
+    guint32 version;
+    const char *cached_uri, *cached_time, *name, *def;
+    const char **choices;
+    gsize num_margins;
+    int i;
+
+    char *path = capabilities_cache_path(uri);
+    file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (file == NULL)
+        return NULL;
+
+    bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    v = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(CAPS_CACHE_FORMAT), bytes, FALSE));
+    g_bytes_unref(bytes);
+
+    /** Don't trust a damaged or foreign file **/
+    if (!g_variant_is_normal_form(v))
+    {
+        g_variant_unref(v);
+        return NULL;
+    }
+
+    g_variant_get(v, "(u&s&s@a(ssas)@a(siia(iiii)))", &version, &cached_uri, &cached_time,
+                  &options, &media);
+    if (version != CAPS_CACHE_VERSION || strcmp(cached_uri, uri) != 0 ||
+        (change_time && strcmp(change_time, cached_time) != 0))
+    {
+        g_variant_unref(options);
+        g_variant_unref(media);
+        g_variant_unref(v);
+        return NULL;
+    }
+
+    PrinterCapabilities *c = new_PrinterCapabilities();
+    c->uri = cpdbGetStringCopy(uri);
+    c->config_change_time = cached_time[0] ? cpdbGetStringCopy(cached_time) : NULL;
+    c->serialized = v;
+    c->arena = arena_new();
+
+    c->num_options = g_variant_n_children(options);
+    c->options = (Option *)arena_alloc(c->arena, sizeof(Option) * c->num_options);
+    for (i = 0; i < c->num_options; i++)
+    {
+        child = g_variant_get_child_value(options, i);
+        g_variant_get(child, "(&s&s^a&s)", &name, &def, &choices);
+        c->options[i].option_name = (char *)name;
+        c->options[i].default_value = (char *)def;
+        c->options[i].supported_values = (char **)choices;
+        c->options[i].num_supported = g_strv_length((char **)choices);
+        g_variant_unref(child);
+    }
+
+    c->num_media = g_variant_n_children(media);
+    c->media = (Media *)arena_alloc(c->arena, sizeof(Media) * c->num_media);
+    for (i = 0; i < c->num_media; i++)
+    {
+        child = g_variant_get_child_value(media, i);
+        g_variant_get(child, "(&sii@a(iiii))", &name, &c->media[i].width, &c->media[i].length,
+                      &margins);
+        c->media[i].name = (char *)name;
+        c->media[i].margins = (int (*)[4])g_variant_get_fixed_array(margins, &num_margins,
+                                                                      sizeof(int) * 4);
+        c->media[i].num_margins = num_margins;
+        g_variant_unref(margins);
+        g_variant_unref(child);
+    }
+
+    g_variant_unref(options);
+    g_variant_unref(media);
+    return c;
+}
+
+/**
+ * The finished GetAllTranslations replies are kept on disk too, one file
+ * per printer URI and locale, so that a restarted backend doesn't have to
+ * load the catalogs and download the printer's strings file again. A file
+ * is used while the printer's config change time is the one it was built
+ * at; whether the strings file was modified since it was downloaded is
+ * checked afterwards with a conditional HEAD request on the warm-up pool,
+ * which drops the file if so. The files are GVariants in native byte order:
+ * (version, printer-uri, locale, printer-config-change-time,
+ *  printer-strings-uri, its Last-Modified date, translations)
+ */
+#define TL_CACHE_VERSION 1
+#define TL_CACHE_FORMAT "(usssss" CPDB_TL_DICT_ARGS ")"
+
+static char *translations_cache_dir(const char *uri)
+{
+    char *digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, uri, -1);
+    char *dir = g_build_filename(g_get_user_cache_dir(), "cpdb", "backend-cups",
+                                 "translations", digest, NULL);
+    g_free(digest);
+    return dir;
+}
+
+static char *translations_cache_path(const char *uri, const char *locale)
+{
+    char *dir = translations_cache_dir(uri);
+    char *name = g_strcanon(g_strdup(locale && *locale ? locale : "C"),
+                            G_CSET_a_2_z G_CSET_A_2_Z G_CSET_DIGITS "._-@", '_');
+    char *file = g_strconcat(name, ".tl", NULL);
+    char *path = g_build_filename(dir, file, NULL);
+    g_free(dir);
+    g_free(name);
+    g_free(file);
+    return path;
+}
+
+/** Connect to the server of the printer's strings file, with a short timeout **/
+static http_t *connect_strings_server(const char *uri, char *resource, int ressize)
+{
+    char scheme[32], userpass[256], host[256];
+    int port;
+
+    if (httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme), userpass, sizeof(userpass),
+                        host, sizeof(host), &port, resource, ressize) < HTTP_URI_STATUS_OK)
+        return NULL;
+
+    return httpConnect2(host, port, NULL, AF_UNSPEC,
+                        (strcmp(scheme, "https") == 0 || strcmp(scheme, "ipps") == 0) ?
+                        HTTP_ENCRYPTION_ALWAYS : HTTP_ENCRYPTION_IF_REQUESTED,
+                        1, 5000, NULL);
+}
+
+/**
+ * Download the printer's strings file into a temporary file. Returns its
+ * name (unlink and free it), and the Last-Modified date of the download in
+ * modified if the server sent one (free it); NULL on failure.
+ */
+static char *download_strings_file(const char *uri, char **modified)
+{
+    char resource[1024], tmpfile[1024], buffer[8192];
+    const char *field;
+    ssize_t bytes;
+    int fd;
+    http_t *http;
+    http_status_t status = HTTP_STATUS_ERROR;
+
+    *modified = NULL;
+    if ((http = connect_strings_server(uri, resource, sizeof(resource))) == NULL)
+        return NULL;
+    if ((fd = cupsTempFd(tmpfile, sizeof(tmpfile))) < 0)
+    {
+        httpClose(http);
+        return NULL;
+    }
+
+    httpClearFields(http);
+    if (httpGet(http, resource) == 0)
+    {
+        while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE)
+            ;
+        if (status == HTTP_STATUS_OK)
+        {
+            if ((field = httpGetField(http, HTTP_FIELD_LAST_MODIFIED)) != NULL && *field)
+                *modified = cpdbGetStringCopy(field);
+            while ((bytes = httpRead2(http, buffer, sizeof(buffer))) > 0)
+            {
+                if (write(fd, buffer, bytes) != bytes)
+                {
+                    status = HTTP_STATUS_ERROR;
+                    break;
+                }
+            }
+        }
+        httpFlush(http);
+    }
+    close(fd);
+    httpClose(http);
+
+    if (status != HTTP_STATUS_OK)
+    {
+        logwarn("Unable to download %s: HTTP status %d\n", uri, (int)status);
+        unlink(tmpfile);
+        free(*modified);
+        *modified = NULL;
+        return NULL;
+    }
+    return cpdbGetStringCopy(tmpfile);
+}
+
+/**
+ * Send a HEAD request for the printer's strings file, with If-Modified-Since
+ * if last_modified is given. Returns the HTTP status, and the Last-Modified
+ * date of the file in modified if the server sent one (free it).
+ */
+static http_status_t check_strings_file(const char *uri, const char *last_modified, char **modified)
+{
+    char resource[1024];
+    const char *field;
+    http_t *http;
+    http_status_t status = HTTP_STATUS_ERROR;
+
+    *modified = NULL;
+    if ((http = connect_strings_server(uri, resource, sizeof(resource))) == NULL)
+        return HTTP_STATUS_ERROR;
+
+    httpClearFields(http);
+    if (last_modified && *last_modified)
+        httpSetField(http, HTTP_FIELD_IF_MODIFIED_SINCE, last_modified);
+    if (httpHead(http, resource) == 0)
+    {
+        while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE)
+            ;
+        if ((field = httpGetField(http, HTTP_FIELD_LAST_MODIFIED)) != NULL && *field)
+            *modified = cpdbGetStringCopy(field);
+        httpFlush(http);
+    }
+    httpClose(http);
+    return status;
+}
+
+/**
+ * last_modified is the Last-Modified date the strings file was downloaded
+ * with, if the printer has one
+ */
+static void store_translations_on_disk(const char *uri, const char *locale, const char *change_time,
+                                       const char *strings_uri, const char *last_modified,
+                                       GVariant *translations)
+{
+    GVariant *v;
+    GError *error = NULL;
+
+    /** Without a date to revalidate them with, they couldn't be used again **/
+    if (strings_uri && last_modified == NULL)
+        return;
+
+    v = g_variant_ref_sink(g_variant_new("(usssss@" CPDB_TL_DICT_ARGS ")",
+                                         TL_CACHE_VERSION, uri, locale ? locale : "",
+                                         change_time ? change_time : "",
+                                         strings_uri ? strings_uri : "",
+                                         last_modified ? last_modified : "",
+                                         translations));
+
+    char *path = translations_cache_path(uri, locale);
+    char *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0700) != 0 ||
+        !g_file_set_contents(path, g_variant_get_data(v), g_variant_get_size(v), &error))
+    {
+        logwarn("Unable to cache the translations of %s in %s: %s\n", uri, path,
+                error ? error->message : "can't create directory");
+        g_clear_error(&error);
+    }
+    g_free(dir);
+    g_free(path);
+    g_variant_unref(v);
+}
+
+/**
+ * Map the cached translations of the printer for the locale from disk, if
+ * they were built at the given printer-config-change-time (any time if
+ * NULL). If they were built from a strings file, its URI and Last-Modified
+ * date are returned in strings_uri and last_modified (free them), for
+ * revalidate_translations() to check.
+ */
+static GVariant *load_translations_from_disk(const char *uri, const char *locale, const char *change_time,
+                                             char **strings_uri, char **last_modified)
+{
+    GMappedFile *file;
+    GBytes *bytes;
+    GVariant *v, *translations = NULL;
+    guint32 version;
+    const char *cached_uri, *cached_locale, *cached_time, *cached_strings_uri, *cached_modified;
+
+    *strings_uri = *last_modified = NULL;
+
+    char *path = translations_cache_path(uri, locale);
+    file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (file == NULL)
+        return NULL;
+
+    bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    v = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(TL_CACHE_FORMAT), bytes, FALSE));
+    g_bytes_unref(bytes);
+
+    /** Don't trust a damaged or foreign file **/
+    if (!g_variant_is_normal_form(v))
+    {
+        g_variant_unref(v);
+        return NULL;
+    }
+
+    g_variant_get(v, "(u&s&s&s&s&s@" CPDB_TL_DICT_ARGS ")", &version, &cached_uri, &cached_locale,
+                  &cached_time, &cached_strings_uri, &cached_modified, &translations);
+    if (version != TL_CACHE_VERSION || strcmp(cached_uri, uri) != 0 ||
+        strcmp(cached_locale, locale ? locale : "") != 0 ||
+        (change_time && strcmp(change_time, cached_time) != 0))
+    {
+        g_variant_unref(translations);
+        g_variant_unref(v);
+        return NULL;
+    }
+
+    if (*cached_strings_uri)
+    {
+        *strings_uri = cpdbGetStringCopy(cached_strings_uri);
+        *last_modified = cpdbGetStringCopy(cached_modified);
+    }
+
+    /** The translations keep the mapped file alive **/
+    g_variant_unref(v);
+    return translations;
+}
+
+/** Remove the cached translations of the printer in all locales **/
+static void remove_translations_from_disk(const char *uri)
+{
+    char *dir = translations_cache_dir(uri);
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const char *name;
+
+    if (d)
+    {
+        while ((name = g_dir_read_name(d)) != NULL)
+        {
+            char *path = g_build_filename(dir, name, NULL);
+            g_unlink(path);
+            g_free(path);
+        }
+        g_dir_close(d);
+        g_rmdir(dir);
+    }
+    g_free(dir);
+}
+
+/**
+ * Read the options and media of the printer. With ready_media, only the
+ * media loaded in the printer are listed if it tells which ones are, so
+ * that its media database doesn't have to be fetched.
+ */
+static PrinterCapabilities *read_printer_capabilities(PrinterCUPS *p, gboolean ready_media)
+{
+    PrinterCapabilities *c = new_PrinterCapabilities();
+    char buf[32];
+
+    c->uri = cpdbGetStringCopy(printer_uri(p));
+    c->printer_name = cpdbGetStringCopy(p->name);
+    c->arena = arena_new();
+    c->num_options = get_all_options(p, c->arena, &c->options);
+    if (ready_media && (c->media_db = get_ready_media(p)) != NULL)
+        c->ready_media_only = TRUE;
+    else
+        c->media_db = get_media_database(p);
+    if (c->media_db)
+    {
+        c->num_media = c->media_db->num_media;
+        c->media = c->media_db->media;
+    }
+    c->num_options = add_media_to_options(p, c->arena, c->media, c->num_media,
+                                          !c->ready_media_only, &c->options, c->num_options);
+    log_arena_stats(c->arena, "Capabilities", p->name);
+
+    /** known by now from the printer attributes **/
+    c->config_change_time = cpdbGetStringCopy(config_change_time(p, buf, sizeof(buf)));
+    return c;
+}
+
+/**
+ * Re-reads the options of a printer whose capabilities came from the
+ * disk cache or list its ready media only, on the warm-up pool with a
+ * connection of its own to the printer
+ */
+typedef struct _Revalidation
+{
+    BackendObj *b;
+    PrinterCUPS *p;
+    PrinterCapabilities *cached;
+    PrinterCapabilities *fresh;
+} Revalidation;
+
+static gboolean finish_revalidation(gpointer user_data)
+{
+    Revalidation *r = (Revalidation *)user_data;
+
+    /** Unless the entry was dropped or replaced meanwhile **/
+    if (!r->cached->dropped &&
+        g_hash_table_lookup(r->b->capabilities, r->cached->uri) == r->cached)
+    {
+        logdebug("Re-read the options of %s\n", r->fresh->uri);
+        g_hash_table_replace(r->b->capabilities, r->fresh->uri, r->fresh);
+    }
+    else
+    {
+        unref_PrinterCapabilities(r->fresh);
+    }
+
+    unref_PrinterCapabilities(r->cached);
+    unref_PrinterCUPS(r->p);
+    free(r);
+    return G_SOURCE_REMOVE;
+}
+
+static void revalidate(gpointer data, gpointer user_data)
+{
+    Revalidation *r = (Revalidation *)data;
+    r->fresh = read_printer_capabilities(r->p, FALSE);
+
+    /** An invalidation meanwhile removed the file, don't bring it back **/
+    g_mutex_lock(&capabilities_lock);
+    if (!r->cached->dropped)
+        store_capabilities_on_disk(r->fresh);
+    g_mutex_unlock(&capabilities_lock);
+
+    g_idle_add(finish_revalidation, r);
+}
+
+static void revalidate_capabilities(BackendObj *b, PrinterCUPS *p, PrinterCapabilities *cached)
+{
+    PrinterCUPS *copy = get_new_PrinterCUPS(p->dest);
+    if (copy == NULL)
+        return;
+
+    Revalidation *r = (Revalidation *)malloc(sizeof(Revalidation));
+    r->b = b;
+    r->p = copy;
+    r->cached = ref_PrinterCapabilities(cached);
+    r->fresh = NULL;
+    push_background_task(revalidate, r);
+}
+
+PrinterCapabilities *peek_printer_capabilities(BackendObj *b, PrinterCUPS *p)
+{
+    PrinterCapabilities *c = g_hash_table_lookup(b->capabilities, printer_uri(p));
+    return c ? ref_PrinterCapabilities(c) : NULL;
+}
+
+PrinterCapabilities *get_printer_capabilities(BackendObj *b, PrinterCUPS *p)
+{
+    char buf[32];
+    const char *uri = printer_uri(p);
+    const char *change_time = config_change_time(p, buf, sizeof(buf));
+    PrinterCapabilities *c = g_hash_table_lookup(b->capabilities, uri);
+
+    /** Only a newer printer-config-change-time than the one the cached
+     * options were read at makes us ask the printer again **/
+    if (c && change_time && c->config_change_time &&
+        strcmp(change_time, c->config_change_time) != 0)
+    {
+        logdebug("Configuration of %s changed, re-reading its options\n", p->name);
+        c = NULL;
+    }
+
+    /** A file of any change time is taken when the printer didn't tell
+     * its own, and like any other one it's re-read in the background **/
+    if (c == NULL && (c = load_capabilities_from_disk(uri, change_time)) != NULL)
+    {
+        c->printer_name = cpdbGetStringCopy(p->name);
+        g_hash_table_replace(b->capabilities, c->uri, c);
+        logdebug("Loaded %d options of %s from the disk cache\n", c->num_options, c->uri);
+        revalidate_capabilities(b, p, c);
+    }
+    else if (c == NULL)
+    {
+        c = read_printer_capabilities(p, TRUE);
+        g_hash_table_replace(b->capabilities, c->uri, c);
+        logdebug("Cached %d options of %s\n", c->num_options, c->uri);
+
+        /** The disk cache only gets the full media list **/
+        if (c->ready_media_only)
+            revalidate_capabilities(b, p, c);
+        else
+            store_capabilities_on_disk(c);
+    }
+    return ref_PrinterCapabilities(c);
+}
+
+static gboolean capabilities_of_printer(gpointer key, gpointer value, gpointer user_data)
+{
+    PrinterCapabilities *c = (PrinterCapabilities *)value;
+    if (strcmp(c->printer_name, (const char *)user_data) != 0)
+        return FALSE;
 
-        optsIndex++;
+    g_mutex_lock(&capabilities_lock);
+    c->dropped = TRUE;
+    char *path = capabilities_cache_path(c->uri);
+    unlink(path);
+    g_free(path);
+    remove_translations_from_disk(c->uri);
+    g_mutex_unlock(&capabilities_lock);
+    return TRUE;
+}
+
+void invalidate_printer_capabilities(BackendObj *b, const char *printer_name)
+{
+    PrinterCUPS *p = (PrinterCUPS *)g_hash_table_lookup(b->printers, printer_name);
+    if (p)
+    {
+        forget_printer_catalog(p);
+        forget_printer_attributes(p);
     }
 
-    *options = opts;
-    return count;
+    guint n = g_hash_table_foreach_remove(b->capabilities, capabilities_of_printer,
+                                          (gpointer)printer_name);
+    if (n)
+        logdebug("Dropped the cached options of %s\n", printer_name);
 }
 const char *get_printer_state(PrinterCUPS *p)
 {
-    const char *str;
-    ensure_printer_connection(p);
-    ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    const char *uri = cupsGetOption("printer-uri-supported",
-                                    p->dest->num_options,
-                                    p->dest->options);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                 "printer-uri", NULL, uri);
-    const char *const requested_attributes[] = {"printer-state"};
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                  "requested-attributes", 1, NULL,
-                  requested_attributes);
+    ipp_t *response;
+    ipp_attribute_t *attr = NULL;
+    int state;
 
-    ipp_t *response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+    g_rec_mutex_lock(&p->lock);
+    if ((response = get_printer_attributes(p)) != NULL)
     {
-        /* request failed */
-        printf("Request failed: %s\n", cupsLastErrorString());
-        return "NA";
+        refresh_printer_status(p);
+        attr = ippFindAttribute(response, "printer-state", IPP_TAG_ENUM);
     }
+    state = attr ? ippGetInteger(attr, 0) : 0;
+    g_rec_mutex_unlock(&p->lock);
 
-    ipp_attribute_t *attr;
-    if ((attr = ippFindAttribute(response, "printer-state",
-                                 IPP_TAG_ENUM)) != NULL)
-    {
-
-        printf("printer-state=%d\n", ippGetInteger(attr, 0));
-        str = map->state[ippGetInteger(attr, 0)];
-    }
-    return str;
+    if (state < IPP_PSTATE_IDLE || state > IPP_PSTATE_STOPPED)
+        return "NA";
+    return map->state[state];
 }
 
 
 
+static void free_PrintDataThreadData(PrintDataThreadData *thread_data)
+{
+    cupsFreeOptions(thread_data->num_options, thread_data->options);
+    if (thread_data->dinfo)
+        cupsFreeDestInfo(thread_data->dinfo);
+    if (thread_data->http)
+        httpClose(thread_data->http);
+    cupsFreeDests(1, thread_data->dest);
+    g_free(thread_data);
+}
+
 void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *job_id_str, char *socket_path, const char *title)
 {
+    /** This also creates the queue of a temporary printer **/
     ensure_printer_connection(p);
     int num_options = 0;
-    cups_option_t *options;
+    cups_option_t *options = NULL;
 
     GVariantIter *iter;
     g_variant_get(settings, "a(ss)", &iter);
@@ -1426,16 +3203,39 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
          */
         num_options = cupsAddOption(option_name, option_value, num_options, &options);
     }
+
+    /** The job gets a connection of its own: the data thread writes to it
+     * long after this returns, while p->http keeps serving the main loop
+     * and the warm-up threads **/
+    PrintDataThreadData *thread_data = g_malloc0(sizeof(PrintDataThreadData));
+    thread_data->num_options = num_options;
+    thread_data->options = options;
+    g_rec_mutex_lock(&p->lock);
+    cupsCopyDest(p->dest, 0, &thread_data->dest);
+    g_rec_mutex_unlock(&p->lock);
+    if (thread_data->dest)
+        thread_data->http = cupsConnectDest(thread_data->dest, CUPS_DEST_FLAGS_NONE,
+                                            300, NULL, NULL, 0, NULL, NULL);
+    if (thread_data->http)
+        thread_data->dinfo = cupsCopyDestInfo(thread_data->http, thread_data->dest);
+    if (thread_data->dinfo == NULL)
+    {
+        logwarn("Unable to connect to printer %s for printing\n", p->name);
+        free_PrintDataThreadData(thread_data);
+        return;
+    }
+
     int job_id = 0;
-    cupsCreateDestJob(p->http, p->dest, p->dinfo,
+    cupsCreateDestJob(thread_data->http, thread_data->dest, thread_data->dinfo,
                       &job_id, title, num_options, options);
-    cupsStartDestDocument(p->http, p->dest, p->dinfo,
+    cupsStartDestDocument(thread_data->http, thread_data->dest, thread_data->dinfo,
 			  job_id, NULL, CUPS_FORMAT_AUTO,
 			  num_options, options, 1);
 
     int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (socket_fd == -1) {
         perror("Error creating socket");
+        free_PrintDataThreadData(thread_data);
         return;
     }
     char mkdir_cmd[256];
@@ -1443,6 +3243,8 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
 	     "mkdir -p %s/cpdb/sockets", getenv("HOME"));
     if (system(mkdir_cmd)!=0){
         perror("Unable to create the sockets directory");
+        close(socket_fd);
+        free_PrintDataThreadData(thread_data);
         return;
     }
     int socket_option = 1;
@@ -1462,6 +3264,7 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
     if (bind(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("Error connecting to CPDB CUPS backend socket");
         close(socket_fd);
+        free_PrintDataThreadData(thread_data);
         return;
     }
 
@@ -1473,11 +3276,6 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
         close(socket_fd);
     }
     
-    // Create a struct to pass data to the thread
-    PrintDataThreadData *thread_data = g_malloc(sizeof(PrintDataThreadData));
-    thread_data->printer = p;
-    thread_data->num_options = num_options;
-    thread_data->options = options;
     thread_data->socket_fd = socket_fd;
 
     // Create a thread for handling data transfer to CUPS
@@ -1485,6 +3283,7 @@ void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *jo
     if (pthread_create(&thread, NULL, print_data_thread, thread_data) != 0) {
         perror("Error creating thread");
         close(socket_fd);
+        free_PrintDataThreadData(thread_data);
     } else {
         // Detach the thread to allow it to run independently
         pthread_detach(thread);
@@ -1510,7 +3309,7 @@ void *print_data_thread(void *data) {
     ssize_t bytesRead;
     while ((bytesRead = read(client_fd, buffer, 1024)) > 0) {
         // Send data to CUPS using cupsWriteRequestData
-        http_status_t http_status = cupsWriteRequestData(thread_data->printer->http, buffer, bytesRead);
+        http_status_t http_status = cupsWriteRequestData(thread_data->http, buffer, bytesRead);
         if (http_status != HTTP_STATUS_CONTINUE) {
             printf("Error writing print data to server.\n");
             break;
@@ -1519,12 +3318,11 @@ void *print_data_thread(void *data) {
 
     // Cleanup and free resources
     close(thread_data->socket_fd);
-    if (cupsFinishDestDocument(thread_data->printer->http, thread_data->printer->dest, thread_data->printer->dinfo) == IPP_STATUS_OK)
+    if (cupsFinishDestDocument(thread_data->http, thread_data->dest, thread_data->dinfo) == IPP_STATUS_OK)
         printf("Document send succeeded.\n");
     else
         printf("Document send failed: %s\n", cupsLastErrorString());
-    cupsFreeOptions(thread_data->num_options, thread_data->options);
-    g_free(thread_data);
+    free_PrintDataThreadData(thread_data);
     g_free(buffer);
 
     return NULL;
@@ -1534,7 +3332,9 @@ void printAllJobs(PrinterCUPS *p)
 {
     ensure_printer_connection(p);
     cups_job_t *jobs;
+    g_rec_mutex_lock(&p->lock);
     int num_jobs = cupsGetJobs2(p->http, &jobs, p->name, 1, CUPS_WHICHJOBS_ALL);
+    g_rec_mutex_unlock(&p->lock);
     for (int i = 0; i < num_jobs; i++)
     {
         print_job(&jobs[i]);
@@ -1587,18 +3387,36 @@ Dialog *get_new_Dialog()
 {
     Dialog *d = g_new(Dialog, 1);
     d->cancel = 0;
+    d->snapshot = NULL;
     d->hide_remote = FALSE;
     d->hide_temp = FALSE;
     d->keep_alive = FALSE;
+    d->batch_signals = FALSE;
+    /** Keys of the pending signals are copies of the printer names, as
+     * the printers may be gone by the time the batch goes out **/
+    d->pending_added = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             (GDestroyNotify)free_string,
+                                             (GDestroyNotify)g_variant_unref);
+    d->pending_removed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               (GDestroyNotify)free_string,
+                                               NULL);
+    d->batch_source = 0;
+    /** Keys are owned by the printers; the values are references into the
+     * backend-wide printer registry **/
     d->printers = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                        (GDestroyNotify)free_string,
-                                        (GDestroyNotify)free_PrinterCUPS);
+                                        NULL,
+                                        (GDestroyNotify)unref_PrinterCUPS);
     return d;
 }
 
 void free_Dialog(Dialog *d)
 {
     printf("freeing dialog..\n");
+    unref_PrinterSnapshot(d->snapshot);
+    if (d->batch_source)
+        g_source_remove(d->batch_source);
+    g_hash_table_destroy(d->pending_added);
+    g_hash_table_destroy(d->pending_removed);
     g_hash_table_destroy(d->printers);
     free(d);
 }
@@ -1616,6 +3434,333 @@ Mappings *get_new_Mappings()
     return m;
 }
 
+/**********Enumeration worker****************/
+static void free_dest(gpointer dest)
+{
+    cupsFreeDests(1, (cups_dest_t *)dest);
+}
+
+static GAsyncQueue *enum_queue = NULL;
+static GThread *enum_thread = NULL;
+
+typedef struct _EnumDestEvent
+{
+    EnumJob *job;
+    unsigned flags;
+    cups_dest_t *dest;
+} EnumDestEvent;
+
+EnumJob *ref_EnumJob(EnumJob *job)
+{
+    g_atomic_int_inc(&job->ref_count);
+    return job;
+}
+
+void unref_EnumJob(EnumJob *job)
+{
+    if (job == NULL || !g_atomic_int_dec_and_test(&job->ref_count))
+        return;
+    if (job->user_data_free)
+        job->user_data_free(job->user_data);
+    g_hash_table_unref(job->printers);
+    g_free(job);
+}
+
+void cancel_EnumJob(EnumJob *job)
+{
+    g_atomic_int_set(&job->cancel, 1);
+}
+
+/** Runs on the main loop **/
+static gboolean deliver_enum_dest(gpointer user_data)
+{
+    EnumDestEvent *ev = (EnumDestEvent *)user_data;
+    if (!g_atomic_int_get(&ev->job->cancel))
+        ev->job->dest_cb(ev->job->b, ev->flags, ev->dest, ev->job->user_data);
+    cupsFreeDests(1, ev->dest);
+    unref_EnumJob(ev->job);
+    g_free(ev);
+    return G_SOURCE_REMOVE;
+}
+
+/** Runs on the main loop **/
+static gboolean finish_enum_job(gpointer user_data)
+{
+    EnumJob *job = (EnumJob *)user_data;
+    if (job->done_cb && !g_atomic_int_get(&job->cancel))
+        job->done_cb(job);
+    unref_EnumJob(job);
+    return G_SOURCE_REMOVE;
+}
+
+/** Runs on the worker thread **/
+static int collect_enum_dest(void *user_data, unsigned flags, cups_dest_t *dest)
+{
+    EnumJob *job = (EnumJob *)user_data;
+    cups_dest_t *dest_copy = NULL;
+
+    if (g_atomic_int_get(&job->cancel))
+        return 0;
+    if (job->notemp && cups_is_temporary(dest))
+        return 1;
+
+    if (flags & CUPS_DEST_FLAGS_REMOVED)
+        g_hash_table_remove(job->printers, dest->name);
+    else
+    {
+        cupsCopyDest(dest, 0, &dest_copy);
+        g_hash_table_replace(job->printers, dest_copy->name, dest_copy);
+    }
+
+    if (job->dest_cb)
+    {
+        EnumDestEvent *ev = g_new(EnumDestEvent, 1);
+        ev->job = ref_EnumJob(job);
+        ev->flags = flags;
+        ev->dest = NULL;
+        cupsCopyDest(dest, 0, &ev->dest);
+        g_idle_add(deliver_enum_dest, ev);
+    }
+    return 1;
+}
+
+static gpointer enum_worker(gpointer data)
+{
+    EnumJob *job;
+    while ((job = (EnumJob *)g_async_queue_pop(enum_queue)) != NULL)
+    {
+        if (!g_atomic_int_get(&job->cancel))
+        {
+            logdebug("Enumerating printers in THREAD %ld\n", pthread_self());
+            cupsEnumDests(CUPS_DEST_FLAGS_NONE,
+                          job->msec,         //timeout
+                          &job->cancel,      //cancel
+                          job->type,         //TYPE
+                          job->mask,         //MASK
+                          collect_enum_dest, //function
+                          job);              //user_data
+        }
+
+        /** Hand the finished table back to the main loop, after the
+         * destinations which are already queued there **/
+        g_idle_add(finish_enum_job, job);
+    }
+    return NULL;
+}
+
+EnumJob *enumerate_printers_async(BackendObj *b, int msec, gboolean notemp, gboolean noremote,
+                                  EnumDestFunc dest_cb, EnumDoneFunc done_cb,
+                                  gpointer user_data, GDestroyNotify user_data_free)
+{
+    EnumJob *job = g_new0(EnumJob, 1);
+    job->ref_count = 2; /** one for the caller, one for the worker **/
+    job->cancel = 0;
+    job->b = b;
+    job->generation = b->generation;
+    job->msec = msec;
+    job->type = noremote ? CUPS_PRINTER_LOCAL : 0;
+    job->mask = noremote ? CUPS_PRINTER_REMOTE : 0;
+    job->notemp = notemp;
+    job->printers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          NULL,
+                                          free_dest);
+    job->dest_cb = dest_cb;
+    job->done_cb = done_cb;
+    job->user_data = user_data;
+    job->user_data_free = user_data_free;
+
+    if (enum_thread == NULL)
+    {
+        enum_queue = g_async_queue_new();
+        enum_thread = g_thread_new("cups-enum", enum_worker, NULL);
+    }
+    g_async_queue_push(enum_queue, job);
+    return job;
+}
+
+/**********Enumeration snapshots****************/
+typedef struct _SnapshotWaiter
+{
+    guint64 generation;     /** the backend's generation when it asked **/
+    gboolean hide_temp;
+    gboolean hide_remote;
+    SnapshotFunc func;
+    gpointer user_data;
+    GDestroyNotify user_data_free;
+} SnapshotWaiter;
+
+static int snapshot_index(gboolean hide_temp, gboolean hide_remote)
+{
+    return (hide_temp ? 1 : 0) | (hide_remote ? 2 : 0);
+}
+
+PrinterSnapshot *ref_PrinterSnapshot(PrinterSnapshot *s)
+{
+    s->ref_count++;
+    return s;
+}
+
+void unref_PrinterSnapshot(PrinterSnapshot *s)
+{
+    if (s == NULL || --s->ref_count > 0)
+        return;
+    g_hash_table_unref(s->printers);
+    unref_PrinterSnapshot(s->base);
+    g_free(s);
+}
+
+/** Caches the snapshot for its filter settings unless a newer one is there already **/
+static void cache_snapshot(BackendObj *b, PrinterSnapshot *s)
+{
+    int i = snapshot_index(s->hide_temp, s->hide_remote);
+    if (b->snapshots[i] && b->snapshots[i]->generation > s->generation)
+        return;
+    unref_PrinterSnapshot(b->snapshots[i]);
+    b->snapshots[i] = ref_PrinterSnapshot(s);
+}
+
+/** Filters the unfiltered snapshot for the given settings, sharing its destinations **/
+static PrinterSnapshot *derive_snapshot(PrinterSnapshot *base, gboolean hide_temp, gboolean hide_remote)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    Dialog filter = {0};
+    PrinterSnapshot *s;
+
+    if (!hide_temp && !hide_remote)
+        return ref_PrinterSnapshot(base);
+
+    filter.hide_temp = hide_temp;
+    filter.hide_remote = hide_remote;
+
+    s = g_new0(PrinterSnapshot, 1);
+    s->ref_count = 1;
+    s->generation = base->generation;
+    s->hide_temp = hide_temp;
+    s->hide_remote = hide_remote;
+    s->base = ref_PrinterSnapshot(base);
+    s->printers = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_iter_init(&iter, base->printers);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if (dialog_accepts_printer(&filter, (cups_dest_t *)value))
+            g_hash_table_insert(s->printers, key, value);
+    }
+    return s;
+}
+
+/** Returns a new reference to the snapshot for the settings, derived from base **/
+static PrinterSnapshot *lookup_snapshot(BackendObj *b, PrinterSnapshot *base,
+                                        gboolean hide_temp, gboolean hide_remote)
+{
+    PrinterSnapshot *s = b->snapshots[snapshot_index(hide_temp, hide_remote)];
+    if (s && s->generation == base->generation)
+        return ref_PrinterSnapshot(s);
+
+    s = derive_snapshot(base, hide_temp, hide_remote);
+    cache_snapshot(b, s);
+    return s;
+}
+
+/** Turns the table of an unfiltered enumeration job into the base snapshot **/
+PrinterSnapshot *store_base_snapshot(EnumJob *job)
+{
+    PrinterSnapshot *s = g_new0(PrinterSnapshot, 1);
+    s->ref_count = 1;
+    s->generation = job->generation;
+    s->hide_temp = FALSE;
+    s->hide_remote = FALSE;
+    s->base = NULL;
+    s->printers = g_hash_table_ref(job->printers);
+    cache_snapshot(job->b, s);
+    logdebug("Printer snapshot of generation %" G_GUINT64_FORMAT " has %u printers\n",
+             s->generation, g_hash_table_size(s->printers));
+    return s;
+}
+
+static void start_snapshot_job(BackendObj *b);
+
+static void snapshot_job_done(EnumJob *job)
+{
+    BackendObj *b = job->b;
+    PrinterSnapshot *base = store_base_snapshot(job);
+    GList *waiters, *l, *later = NULL;
+
+    waiters = g_list_reverse(b->snapshot_waiters);
+    b->snapshot_waiters = NULL;
+    unref_EnumJob(b->snapshot_job);
+    b->snapshot_job = NULL;
+
+    for (l = waiters; l != NULL; l = l->next)
+    {
+        SnapshotWaiter *w = (SnapshotWaiter *)l->data;
+
+        /** Asked after a change the enumeration may have missed **/
+        if (w->generation > base->generation)
+        {
+            later = g_list_prepend(later, w);
+            continue;
+        }
+
+        PrinterSnapshot *s = lookup_snapshot(b, base, w->hide_temp, w->hide_remote);
+        w->func(b, s, w->user_data);
+        unref_PrinterSnapshot(s);
+        if (w->user_data_free)
+            w->user_data_free(w->user_data);
+        g_free(w);
+    }
+    g_list_free(waiters);
+    unref_PrinterSnapshot(base);
+
+    if (later)
+    {
+        b->snapshot_waiters = later;
+        start_snapshot_job(b);
+    }
+}
+
+static void start_snapshot_job(BackendObj *b)
+{
+    b->snapshot_job = enumerate_printers_async(b, 1000, FALSE, FALSE,
+                                               NULL, snapshot_job_done,
+                                               NULL, NULL);
+}
+
+void get_printer_snapshot(BackendObj *b, gboolean hide_temp, gboolean hide_remote,
+                          SnapshotFunc func, gpointer user_data, GDestroyNotify user_data_free)
+{
+    PrinterSnapshot *base = b->snapshots[snapshot_index(FALSE, FALSE)];
+
+    if (base && base->generation == b->generation)
+    {
+        PrinterSnapshot *s = lookup_snapshot(b, base, hide_temp, hide_remote);
+        func(b, s, user_data);
+        unref_PrinterSnapshot(s);
+        if (user_data_free)
+            user_data_free(user_data);
+        return;
+    }
+
+    SnapshotWaiter *w = g_new(SnapshotWaiter, 1);
+    w->generation = b->generation;
+    w->hide_temp = hide_temp;
+    w->hide_remote = hide_remote;
+    w->func = func;
+    w->user_data = user_data;
+    w->user_data_free = user_data_free;
+    b->snapshot_waiters = g_list_prepend(b->snapshot_waiters, w);
+
+    /** An enumeration started before the latest change is left to
+     * finish for the earlier waiters; this one then gets another **/
+    if (b->snapshot_job == NULL)
+        start_snapshot_job(b);
+}
+
+void invalidate_printer_snapshots(BackendObj *b)
+{
+    b->generation++;
+}
+
 /*****************CUPS and IPP helpers*********************/
 const char *cups_printer_state(cups_dest_t *dest)
 {
@@ -1638,237 +3783,414 @@ gboolean cups_is_accepting_jobs(cups_dest_t *dest)
     return cpdbGetBoolean(val);
 }
 
-void cups_get_Resolution(cups_dest_t *dest, int *xres, int *yres)
+void cups_get_Resolution(cups_dest_t *dest, int *xres, int *yres)
+{
+    http_t *http = cupsConnectDest(dest, CUPS_DEST_FLAGS_NONE, 500, NULL, NULL, 0, NULL, NULL);
+    g_assert_nonnull(http);
+    cups_dinfo_t *dinfo = cupsCopyDestInfo(http, dest);
+    g_assert_nonnull(dinfo);
+    ipp_attribute_t *attr = cupsFindDestDefault(http, dest, dinfo, "printer-resolution");
+    ipp_res_t *units;
+    *xres = ippGetResolution(attr, 0, yres, units);
+}
+
+char *cups_retrieve_string(cups_dest_t *dest, const char *option_name)
+{
+    /** this funtion is kind of a wrapper , to ensure that the return value is never NULL
+    , as that can cause the backend to segFault
+    **/
+    g_assert_nonnull(dest);
+    g_assert_nonnull(option_name);
+    char *ans = NULL;
+    ans = cpdbGetStringCopy(cupsGetOption(option_name, dest->num_options, dest->options));
+
+    if (ans)
+        return ans;
+
+    return cpdbGetStringCopy("NA");
+}
+
+gboolean cups_is_temporary(cups_dest_t *dest)
+{
+    g_assert_nonnull(dest);
+    if (cupsGetOption("printer-uri-supported", dest->num_options, dest->options))
+        return FALSE;
+    return TRUE;
+}
+
+gboolean cups_is_remote(cups_dest_t *dest)
+{
+    g_assert_nonnull(dest);
+    const char *type = cupsGetOption("printer-type", dest->num_options, dest->options);
+    if (type == NULL)
+        return FALSE;
+    return (strtoul(type, NULL, 10) & CUPS_PRINTER_REMOTE) ? TRUE : FALSE;
+}
+
+static const char *format_res_from_ipp(ipp_attribute_t *attr, int index, char *buf, size_t bufsize)
+{
+    int xres, yres;
+    ipp_res_t units;
+    xres = ippGetResolution(attr, index, &yres, &units);
+
+    char *unit = units == IPP_RES_PER_INCH ? "dpi" : "dpcm";
+    if (xres == yres)
+        snprintf(buf, bufsize, "%d%s", xres, unit);
+    else
+        snprintf(buf, bufsize, "%dx%d%s", xres, yres, unit);
+
+    return buf;
+}
+
+const char *format_ipp_value(ipp_attribute_t *attr, int index, const char *option_name,
+                             char *buf, size_t bufsize)
+{
+    const char *str;
+    int upper, lower;
+
+    /** first deal with the totally unique cases **/
+    if (ipp_keyword_flags(option_name) & KW_ORIENTATION)
+    {
+        str = ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, index));
+        return strcmp("0", str) == 0 ? "automatic-rotation" : str;
+    }
+
+    /** Then deal with the generic cases **/
+    switch (ippGetValueTag(attr))
+    {
+    case IPP_TAG_INTEGER:
+        snprintf(buf, bufsize, "%d", ippGetInteger(attr, index));
+        return buf;
+
+    case IPP_TAG_ENUM:
+        return ippEnumString(option_name, ippGetInteger(attr, index));
+
+    case IPP_TAG_RANGE:
+        lower = ippGetRange(attr, index, &upper);
+        snprintf(buf, bufsize, "%d-%d", lower, upper);
+        return buf;
+
+    case IPP_TAG_RESOLUTION:
+        return format_res_from_ipp(attr, index, buf, bufsize);
+    default:
+        return ippGetString(attr, index, NULL);
+    }
+}
+
+char *extract_ipp_attribute(ipp_attribute_t *attr, int index, const char *option_name)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+    return cpdbGetStringCopy(format_ipp_value(attr, index, option_name, buf, sizeof(buf)));
+}
+
+char *extract_res_from_ipp(ipp_attribute_t *attr, int index)
+{
+    char buf[IPP_VALUE_BUFSIZE];
+    return cpdbGetStringCopy(format_res_from_ipp(attr, index, buf, sizeof(buf)));
+}
+
+char *extract_string_from_ipp(ipp_attribute_t *attr, int index)
+{
+    return cpdbGetStringCopy(ippGetString(attr, index, NULL));
+}
+
+char *extract_orientation_from_ipp(ipp_attribute_t *attr, int index)
+{
+    return cpdbGetStringCopy(format_ipp_value(attr, index, CUPS_ORIENTATION, NULL, 0));
+}
+
+void print_job(cups_job_t *j)
+{
+    printf("title : %s\n", j->title);
+    printf("dest : %s\n", j->dest);
+    printf("job-id : %d\n", j->id);
+    printf("user : %s\n", j->user);
+
+    char *state = translate_job_state(j->state);
+    printf("state : %s\n", state);
+}
+
+/**
+ * Parsed catalogs used for translations: the system one per locale and the
+ * printers' strings files per URI. Loading them means parsing a large file
+ * or an HTTP download, so it's done once and they're shared by all printers
+ * and all lookups until the printer is modified.
+ *
+ * cfCatalogLookUpOption() and cfCatalogLookUpChoice() search the catalog
+ * arrays comparing strings, so each catalog is indexed by option name, and
+ * each option by choice name, when it's loaded.
+ */
+typedef struct _CatalogOption
+{
+    const char *text;
+    GHashTable *choices;    /** choice name -> text **/
+} CatalogOption;
+
+typedef struct _CatalogIndex
 {
-    http_t *http = cupsConnectDest(dest, CUPS_DEST_FLAGS_NONE, 500, NULL, NULL, 0, NULL, NULL);
-    g_assert_nonnull(http);
-    cups_dinfo_t *dinfo = cupsCopyDestInfo(http, dest);
-    g_assert_nonnull(dinfo);
-    ipp_attribute_t *attr = cupsFindDestDefault(http, dest, dinfo, "printer-resolution");
-    ipp_res_t *units;
-    *xres = ippGetResolution(attr, 0, yres, units);
+    cups_array_t *catalog;  /** the keys and texts point into it **/
+    GHashTable *options;    /** option name -> CatalogOption* **/
+    char *last_modified;    /** of the downloaded strings file, if the server sent it **/
+} CatalogIndex;
+
+static GMutex catalogs_lock;
+static GHashTable *system_catalogs = NULL;     /** locale ("" for none) -> CatalogIndex* **/
+static GHashTable *printer_catalogs = NULL;    /** printer-strings-uri -> CatalogIndex* **/
+static GHashTable *failed_catalogs = NULL;     /** printer-strings-uri -> gint64* retry time **/
+
+/** The catalogs compare names ignoring case **/
+static guint ascii_case_hash(gconstpointer key)
+{
+    const char *p;
+    guint h = 5381;
+
+    for (p = (const char *)key; *p; p++)
+        h = (h << 5) + h + (guchar)g_ascii_tolower(*p);
+    return h;
 }
 
-int add_printer_to_ht(void *user_data, unsigned flags, cups_dest_t *dest)
+static gboolean ascii_case_equal(gconstpointer a, gconstpointer b)
 {
-    GHashTable *h = (GHashTable *)user_data;
-    char *printername = cpdbGetStringCopy(dest->name);
-    cups_dest_t *dest_copy = NULL;
-    cupsCopyDest(dest, 0, &dest_copy);
-    g_hash_table_insert(h, printername, dest_copy);
-
-    return 1;
+    return g_ascii_strcasecmp((const char *)a, (const char *)b) == 0;
 }
-int add_printer_to_ht_no_temp(void *user_data, unsigned flags, cups_dest_t *dest)
+
+static void free_catalog_option(CatalogOption *opt)
 {
-    if (cups_is_temporary(dest))
-        return 1;
-    GHashTable *h = (GHashTable *)user_data;
-    char *printername = cpdbGetStringCopy(dest->name);
-    cups_dest_t *dest_copy = NULL;
-    cupsCopyDest(dest, 0, &dest_copy);
-    g_hash_table_insert(h, printername, dest_copy);
-    return 1;
+    g_hash_table_destroy(opt->choices);
+    g_free(opt);
 }
 
-GHashTable *cups_get_printers(gboolean notemp, gboolean noremote)
+static CatalogIndex *index_catalog(cups_array_t *catalog)
 {
-    cups_dest_cb_t cb = add_printer_to_ht;
-    unsigned type = 0, mask = 0;
-    if (noremote)
-    {
-        type = CUPS_PRINTER_LOCAL;
-        mask = CUPS_PRINTER_REMOTE;
-    }
-    if (notemp)
+    CatalogIndex *idx = g_new(CatalogIndex, 1);
+    cf_catalog_opt_strings_t *opt;
+    cf_catalog_choice_strings_t *choice;
+    CatalogOption *entry;
+
+    idx->catalog = catalog;
+    idx->last_modified = NULL;
+    idx->options = g_hash_table_new_full(ascii_case_hash, ascii_case_equal, NULL,
+                                         (GDestroyNotify)free_catalog_option);
+    for (opt = cupsArrayFirst(catalog); opt; opt = cupsArrayNext(catalog))
     {
-        cb = add_printer_to_ht_no_temp;
+        /** Like the lookup functions, the first entry of a name wins **/
+        if (g_hash_table_contains(idx->options, opt->name))
+            continue;
+
+        entry = g_new(CatalogOption, 1);
+        entry->text = opt->human_readable;
+        entry->choices = g_hash_table_new(ascii_case_hash, ascii_case_equal);
+        for (choice = cupsArrayFirst(opt->choices); choice; choice = cupsArrayNext(opt->choices))
+        {
+            if (!g_hash_table_contains(entry->choices, choice->name))
+                g_hash_table_insert(entry->choices, choice->name, choice->human_readable);
+        }
+        g_hash_table_insert(idx->options, opt->name, entry);
     }
+    return idx;
+}
 
-    GHashTable *printers_ht = g_hash_table_new(g_str_hash, g_str_equal);
-    cupsEnumDests(CUPS_DEST_FLAGS_NONE,
-                  1000,         //timeout
-                  NULL,         //cancel
-                  type,         //TYPE
-                  mask,         //MASK
-                  cb,           //function
-                  printers_ht); //user_data
+static void free_catalog_index(CatalogIndex *idx)
+{
+    g_hash_table_destroy(idx->options);
+    cupsArrayDelete(idx->catalog);
+    free(idx->last_modified);
+    g_free(idx);
+}
 
-    return printers_ht;
+/** Load and index a catalog **/
+static CatalogIndex *load_catalog(const char *uri, const char *locale)
+{
+    cups_array_t *catalog = cfCatalogOptionArrayNew();
+    cfCatalogLoad((char *)uri, (char *)locale, catalog);
+    return index_catalog(catalog);
 }
-GHashTable *cups_get_all_printers()
+
+/**
+ * Download and load the printer's strings file, remembering the date it
+ * had, so that the translations built from it can be revalidated later;
+ * NULL if it couldn't be downloaded
+ */
+static CatalogIndex *load_printer_catalog(const char *uri)
 {
-    printf("all printers\n");
-    // to do : fix
-    GHashTable *printers_ht = g_hash_table_new(g_str_hash, g_str_equal);
-    cupsEnumDests(CUPS_DEST_FLAGS_NONE,
-                  3000,              //timeout
-                  NULL,              //cancel
-                  0,                 //TYPE
-                  0,                 //MASK
-                  add_printer_to_ht, //function
-                  printers_ht);      //user_data
+    CatalogIndex *idx;
+    char *modified;
+    char *path = download_strings_file(uri, &modified);
 
-    return printers_ht;
+    if (path == NULL)
+        return NULL;
+
+    idx = load_catalog(path, NULL);
+    idx->last_modified = modified;
+    unlink(path);
+    free(path);
+    return idx;
 }
-GHashTable *cups_get_local_printers()
-{
-    printf("local printers\n");
-    //to do: fix
-    GHashTable *printers_ht = g_hash_table_new(g_str_hash, g_str_equal);
-    cupsEnumDests(CUPS_DEST_FLAGS_NONE,
-                  1200,                //timeout
-                  NULL,                //cancel
-                  CUPS_PRINTER_LOCAL,  //TYPE
-                  CUPS_PRINTER_REMOTE, //MASK
-                  add_printer_to_ht,   //function
-                  printers_ht);        //user_data
 
-    return printers_ht;
+static GHashTable *new_catalog_table()
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal,
+                                 (GDestroyNotify)free_string,
+                                 (GDestroyNotify)free_catalog_index);
 }
-char *cups_retrieve_string(cups_dest_t *dest, const char *option_name)
+
+static CatalogIndex *get_system_catalog(const char *locale)
 {
-    /** this funtion is kind of a wrapper , to ensure that the return value is never NULL
-    , as that can cause the backend to segFault
-    **/
-    g_assert_nonnull(dest);
-    g_assert_nonnull(option_name);
-    char *ans = NULL;
-    ans = cpdbGetStringCopy(cupsGetOption(option_name, dest->num_options, dest->options));
+    CatalogIndex *idx;
+    const char *key = locale ? locale : "";
 
-    if (ans)
-        return ans;
+    g_mutex_lock(&catalogs_lock);
+    if (system_catalogs == NULL)
+        system_catalogs = new_catalog_table();
 
-    return cpdbGetStringCopy("NA");
+    if ((idx = g_hash_table_lookup(system_catalogs, key)) == NULL)
+    {
+        idx = load_catalog(NULL, locale);
+        g_hash_table_insert(system_catalogs, cpdbGetStringCopy(key), idx);
+        logdebug("Loaded the system catalog for locale '%s', %u options\n",
+                 key, g_hash_table_size(idx->options));
+    }
+    g_mutex_unlock(&catalogs_lock);
+
+    return idx;
 }
 
-gboolean cups_is_temporary(cups_dest_t *dest)
+/** Points into p->attrs, so the caller holds p->lock **/
+static const char *printer_strings_uri(PrinterCUPS *p)
 {
-    g_assert_nonnull(dest);
-    if (cupsGetOption("printer-uri-supported", dest->num_options, dest->options))
-        return FALSE;
-    return TRUE;
+    ipp_attribute_t *attr;
+    ipp_t *response = get_printer_attributes(p);
+
+    if (response == NULL ||
+        (attr = ippFindAttribute(response, "printer-strings-uri", IPP_TAG_URI)) == NULL)
+        return NULL;
+    return ippGetString(attr, 0, NULL);
 }
 
-char *extract_ipp_attribute(ipp_attribute_t *attr, int index, const char *option_name)
+/**
+ * The catalog of the printer's strings file; NULL if it has none or it
+ * couldn't be downloaded. The download happens without holding p->lock or
+ * catalogs_lock, so the other printers and lookups don't wait for it; if
+ * two callers download the same file, the first one to finish is kept.
+ * A failed download isn't retried for STRINGS_RETRY_SEC.
+ */
+static CatalogIndex *get_printer_catalog(PrinterCUPS *p)
 {
-    /** first deal with the totally unique cases **/
-    if (strcmp(option_name, CUPS_ORIENTATION) == 0)
-        return extract_orientation_from_ipp(attr, index);
+    CatalogIndex *idx, *loaded;
+    gint64 *retry;
+    char *uri;
+
+    g_rec_mutex_lock(&p->lock);
+    uri = cpdbGetStringCopy(printer_strings_uri(p));
+    g_rec_mutex_unlock(&p->lock);
+    if (uri == NULL)
+        return NULL;
 
-    /** Then deal with the generic cases **/
-    char *str;
-    const char *attrstr;
-    switch (ippGetValueTag(attr))
+    g_mutex_lock(&catalogs_lock);
+    if (printer_catalogs == NULL)
     {
-    case IPP_TAG_INTEGER:
-        str = (char *)(malloc(sizeof(char) * 50));
-        snprintf(str, sizeof(str), "%d", ippGetInteger(attr, index));
-        break;
+        printer_catalogs = new_catalog_table();
+        failed_catalogs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                (GDestroyNotify)free_string, g_free);
+    }
+    idx = g_hash_table_lookup(printer_catalogs, uri);
+    retry = g_hash_table_lookup(failed_catalogs, uri);
+    g_mutex_unlock(&catalogs_lock);
 
-    case IPP_TAG_ENUM:
-        attrstr = ippEnumString(option_name, ippGetInteger(attr, index));
-	str = strdup(attrstr);
-        break;
+    if (idx || (retry && g_get_monotonic_time() < *retry))
+    {
+        free(uri);
+        return idx;
+    }
 
-    case IPP_TAG_RANGE:
-        str = (char *)(malloc(sizeof(char) * 100));
-        int upper, lower = ippGetRange(attr, index, &upper);
-        snprintf(str, sizeof(str), "%d-%d", lower, upper);
-        break;
+    loaded = load_printer_catalog(uri);
 
-    case IPP_TAG_RESOLUTION:
-        return extract_res_from_ipp(attr, index);
-    default:
-        return extract_string_from_ipp(attr, index);
+    g_mutex_lock(&catalogs_lock);
+    if (loaded == NULL)
+    {
+        logwarn("Unable to load the strings of %s from %s\n", p->name, uri);
+        retry = g_new(gint64, 1);
+        *retry = g_get_monotonic_time() + STRINGS_RETRY_SEC * G_USEC_PER_SEC;
+        g_hash_table_insert(failed_catalogs, cpdbGetStringCopy(uri), retry);
+    }
+    else if ((idx = g_hash_table_lookup(printer_catalogs, uri)) != NULL)
+    {
+        free_catalog_index(loaded);
     }
+    else
+    {
+        idx = loaded;
+        g_hash_table_insert(printer_catalogs, cpdbGetStringCopy(uri), idx);
+        g_hash_table_remove(failed_catalogs, uri);
+        logdebug("Loaded the strings of %s from %s\n", p->name, uri);
+    }
+    g_mutex_unlock(&catalogs_lock);
+    free(uri);
 
-    return str;
+    return idx;
 }
 
-char *extract_res_from_ipp(ipp_attribute_t *attr, int index)
+static void forget_catalog(const char *strings_uri)
 {
-    int xres, yres;
-    ipp_res_t units;
-    xres = ippGetResolution(attr, index, &yres, &units);
-
-    char *unit = units == IPP_RES_PER_INCH ? "dpi" : "dpcm";
-    char buf[100];
-    if (xres == yres)
-        snprintf(buf, sizeof(buf), "%d%s", xres, unit);
-    else
-        snprintf(buf, sizeof(buf), "%dx%d%s", xres, yres, unit);
-
-    return cpdbGetStringCopy(buf);
+    g_mutex_lock(&catalogs_lock);
+    if (printer_catalogs)
+    {
+        g_hash_table_remove(printer_catalogs, strings_uri);
+        g_hash_table_remove(failed_catalogs, strings_uri);
+    }
+    g_mutex_unlock(&catalogs_lock);
 }
 
-char *extract_string_from_ipp(ipp_attribute_t *attr, int index)
+void forget_printer_catalog(PrinterCUPS *p)
 {
-    return cpdbGetStringCopy(ippGetString(attr, index, NULL));
+    const char *uri;
+
+    g_rec_mutex_lock(&p->lock);
+    if (p->attrs && (uri = printer_strings_uri(p)) != NULL)
+        forget_catalog(uri);
+    g_rec_mutex_unlock(&p->lock);
 }
 
-char *extract_orientation_from_ipp(ipp_attribute_t *attr, int index)
+/**
+ * The translation of the option, from the printer's catalog if it has one
+ * there, else from the system catalog, as cfCatalogLookUpOption() does
+ */
+static const char *lookup_option_text(CatalogIndex *system, CatalogIndex *printer,
+                                      const char *option_name)
 {
-    char *str = cpdbGetStringCopy(ippEnumString(CUPS_ORIENTATION, ippGetInteger(attr, index)));
-    if (strcmp("0", str) == 0)
-        str = cpdbGetStringCopy("automatic-rotation");
-    return str;
+    CatalogOption *opt;
+
+    if (printer && (opt = g_hash_table_lookup(printer->options, option_name)) != NULL)
+        return opt->text;
+    if (system && (opt = g_hash_table_lookup(system->options, option_name)) != NULL)
+        return opt->text;
+    return NULL;
 }
 
-void print_job(cups_job_t *j)
+static const char *lookup_choice_text(CatalogIndex *system, CatalogIndex *printer,
+                                      const char *option_name, const char *choice_name)
 {
-    printf("title : %s\n", j->title);
-    printf("dest : %s\n", j->dest);
-    printf("job-id : %d\n", j->id);
-    printf("user : %s\n", j->user);
-
-    char *state = translate_job_state(j->state);
-    printf("state : %s\n", state);
+    CatalogOption *opt;
+    const char *text;
+
+    if (printer && (opt = g_hash_table_lookup(printer->options, option_name)) != NULL &&
+        (text = g_hash_table_lookup(opt->choices, choice_name)) != NULL)
+        return text;
+    if (system && (opt = g_hash_table_lookup(system->options, option_name)) != NULL)
+        return g_hash_table_lookup(opt->choices, choice_name);
+    return NULL;
 }
 
 char *get_option_translation(PrinterCUPS *p,
                              const char *option_name,
                              const char *locale)
 {
-    char *copy;
-    const char *uri, *translation;
-    static const char *const req_attrs[] = {"printer-strings-uri"};
-    ipp_attribute_t *attr;
-    ipp_t *request, *response;
-    cups_array_t *opts_catalog, *printer_opts_catalog;
-
-    ensure_printer_connection(p);
-    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    uri = cupsGetOption("printer-uri-supported", 
-                        p->dest->num_options,
-                        p->dest->options);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                    "printer-uri", NULL, uri);
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                    "requested-attributes", 1, NULL, req_attrs);
-    response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
-    {
-        /* request failed */
-        printf("Request failed: %s\n", cupsLastErrorString());
+    if (get_printer_attributes(p) == NULL)
         return cpdbGetStringCopy(option_name);
-    }
-
-    opts_catalog = cfCatalogOptionArrayNew();
-    cfCatalogLoad(NULL, locale, opts_catalog);
-    if ((attr = ippFindAttribute(response, "printer-strings-uri",
-                                    IPP_TAG_URI)) != NULL)
-    {
-        printer_opts_catalog = cfCatalogOptionArrayNew();
-        cfCatalogLoad(ippGetString(attr, 0, NULL), NULL, printer_opts_catalog);
-    }
 
-    translation = cfCatalogLookUpOption((char *)option_name, 
-                                        opts_catalog, printer_opts_catalog);
-    copy = cpdbGetStringCopy(translation);
-    cupsArrayDelete(opts_catalog);
-    cupsArrayDelete(printer_opts_catalog);
-    return copy;
+    return cpdbGetStringCopy(lookup_option_text(get_system_catalog(locale),
+                                                get_printer_catalog(p),
+                                                option_name));
 }
 
 char *get_choice_translation(PrinterCUPS *p,
@@ -1876,103 +4198,207 @@ char *get_choice_translation(PrinterCUPS *p,
                              const char *choice_name,
                              const char *locale)
 {
-    char *copy;
-    const char *uri, *translation;
-    static const char *const req_attrs[] = {"printer-strings-uri"};
-    ipp_attribute_t *attr;
-    ipp_t *request, *response;
-    cups_array_t *opts_catalog, *printer_opts_catalog;
-
-    ensure_printer_connection(p);
-    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    uri = cupsGetOption("printer-uri-supported", 
-                        p->dest->num_options,
-                        p->dest->options);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                    "printer-uri", NULL, uri);
-    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                    "requested-attributes", 1, NULL, req_attrs);
-    response = cupsDoRequest(p->http, request, "/");
-    if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
-    {
-        /* request failed */
-        printf("Request failed: %s\n", cupsLastErrorString());
+    if (get_printer_attributes(p) == NULL)
         return cpdbGetStringCopy(choice_name);
-    }
-
-    opts_catalog = cfCatalogOptionArrayNew();
-    cfCatalogLoad(NULL, locale, opts_catalog);
-    if ((attr = ippFindAttribute(response, "printer-strings-uri",
-                                    IPP_TAG_URI)) != NULL)
-    {
-        printer_opts_catalog = cfCatalogOptionArrayNew();
-        cfCatalogLoad(ippGetString(attr, 0, NULL), NULL, printer_opts_catalog);
-    }
 
-    translation = cfCatalogLookUpChoice((char *)choice_name, (char *)option_name,
-                                        opts_catalog, printer_opts_catalog);
-    copy = cpdbGetStringCopy(translation);
-    cupsArrayDelete(opts_catalog);
-    cupsArrayDelete(printer_opts_catalog);
-    return copy;
+    return cpdbGetStringCopy(lookup_choice_text(get_system_catalog(locale),
+                                                get_printer_catalog(p),
+                                                option_name, choice_name));
 }
 
-GVariant *get_printer_translations(PrinterCUPS *p, const char *locale)
+static GVariant *build_printer_translations(PrinterCUPS *p, PrinterCapabilities *caps, const char *locale)
 {
     int num_opts;
     Option *opts;
     GVariant *translations;
     GVariantBuilder *builder;
+    CatalogIndex *system_catalog = NULL, *printer_catalog = NULL;
+    gboolean have_attrs;
+    gint64 start;
+    int num_strings = 0;
 
     char *group;
-    char *name_tr, *group_tr, *choice_tr;
+    const char *name_tr, *choice_tr;
+    char *group_tr;
     char *name_key, *group_key, *choice_key;
 
-    num_opts = get_all_options(p, &opts);
+    start = g_get_monotonic_time();
+    if ((have_attrs = get_printer_attributes(p) != NULL))
+    {
+        system_catalog = get_system_catalog(locale);
+        printer_catalog = get_printer_catalog(p);
+    }
+
+    num_opts = caps->num_options;
+    opts = caps->options;
     builder = g_variant_builder_new(G_VARIANT_TYPE(CPDB_TL_DICT_ARGS));
     for (int i = 0; i < num_opts; i++)
     {
         /* add translation for option name */
-        name_tr = get_option_translation(p, opts[i].option_name, locale);
+        name_tr = have_attrs ? lookup_option_text(system_catalog, printer_catalog, opts[i].option_name)
+                             : opts[i].option_name;
         name_key = cpdbConcatSep(CPDB_OPT_PREFIX, opts[i].option_name);
         if (name_tr)
         {
             logdebug("Translation '%s' : '%s'\n", name_key, name_tr);
             g_variant_builder_add(builder, CPDB_TL_ARGS, name_key, name_tr);
+            num_strings++;
         }
-        g_free(name_tr);
 
         /* add translation for option group */
-        group = cpdbGetGroup(opts[i].option_name);
+        group = (char *)get_option_group(opts[i].option_name);
         group_key = cpdbConcatSep(CPDB_GRP_PREFIX, group);
         group_tr = cpdbGetGroupTranslation2(group, locale);
         if (group_tr)
         {
             logdebug("Translation '%s' : '%s'\n", group_key, group_tr);
             g_variant_builder_add(builder, CPDB_TL_ARGS, group_key, group_tr);
+            num_strings++;
         }
-        g_free(group);
         g_free(group_key);
         g_free(group_tr);
 
         /* add translation for option choices */
         for (int j = 0; j < opts[i].num_supported; j++)
         {
-            choice_tr = get_choice_translation(p, opts[i].option_name, opts[i].supported_values[j], locale);
+            choice_tr = have_attrs ? lookup_choice_text(system_catalog, printer_catalog,
+                                                         opts[i].option_name, opts[i].supported_values[j])
+                                   : opts[i].supported_values[j];
             choice_key = cpdbConcatSep(name_key, opts[i].supported_values[j]);
             if (choice_tr)
             {
                 logdebug("Translation '%s' : '%s'\n", choice_key, choice_tr);
                 g_variant_builder_add(builder, CPDB_TL_ARGS, choice_key, choice_tr);
+                num_strings++;
             }
             g_free(choice_key);
-            g_free(choice_tr);
         }
 
         g_free(name_key);
     }
-    translations = g_variant_builder_end(builder);
-    free_options(num_opts, opts);
+    translations = g_variant_ref_sink(g_variant_builder_end(builder));
+    g_variant_builder_unref(builder);
+    loginfo("Translated %d strings of %s for locale '%s' in %ld us\n", num_strings, p->name,
+            locale ? locale : "", (long)(g_get_monotonic_time() - start));
+    return translations;
+}
+
+/**
+ * Checks with the printer's server whether the strings file of translations
+ * loaded from the disk cache was modified since, on the warm-up pool
+ */
+typedef struct _StringsCheck
+{
+    BackendObj *b;
+    char *uri;
+    char *locale;
+    char *strings_uri;
+    char *last_modified;
+    gboolean modified;
+} StringsCheck;
+
+static gboolean finish_translations_revalidation(gpointer user_data)
+{
+    StringsCheck *r = (StringsCheck *)user_data;
+    PrinterCapabilities *caps;
+
+    if (r->modified)
+    {
+        logdebug("Strings of %s changed since %s, dropping its cached translations\n",
+                 r->uri, r->last_modified);
+        char *path = translations_cache_path(r->uri, r->locale);
+        unlink(path);
+        g_free(path);
+        forget_catalog(r->strings_uri);
+        if ((caps = g_hash_table_lookup(r->b->capabilities, r->uri)) != NULL)
+            g_hash_table_remove(caps->translations, r->locale ? r->locale : "");
+    }
+
+    free(r->uri);
+    free(r->locale);
+    free(r->strings_uri);
+    free(r->last_modified);
+    free(r);
+    return G_SOURCE_REMOVE;
+}
+
+static void check_translations(gpointer data, gpointer user_data)
+{
+    StringsCheck *r = (StringsCheck *)data;
+    char *modified;
+
+    r->modified = check_strings_file(r->strings_uri, r->last_modified, &modified) !=
+                  HTTP_STATUS_NOT_MODIFIED;
+    free(modified);
+    g_idle_add(finish_translations_revalidation, r);
+}
+
+/** Takes over strings_uri and last_modified **/
+static void revalidate_translations(BackendObj *b, const char *uri, const char *locale,
+                                    char *strings_uri, char *last_modified)
+{
+    StringsCheck *r = (StringsCheck *)malloc(sizeof(StringsCheck));
+    r->b = b;
+    r->uri = cpdbGetStringCopy(uri);
+    r->locale = cpdbGetStringCopy(locale);
+    r->strings_uri = strings_uri;
+    r->last_modified = last_modified;
+    r->modified = FALSE;
+    push_background_task(check_translations, r);
+}
+
+GVariant *get_printer_translations(BackendObj *b, PrinterCUPS *p, const char *locale)
+{
+    PrinterCapabilities *caps;
+    GVariant *translations;
+    CatalogIndex *catalog;
+    char *strings_uri, *last_modified;
+    gboolean complete = TRUE;
+
+    caps = get_printer_capabilities(b, p);
+    translations = g_hash_table_lookup(caps->translations, locale ? locale : "");
+    if (translations)
+    {
+        g_variant_ref(translations);
+        unref_PrinterCapabilities(caps);
+        return translations;
+    }
+
+    /** They depend on the options, so go with the time those were read at **/
+    if ((translations = load_translations_from_disk(caps->uri, locale, caps->config_change_time,
+                                                    &strings_uri, &last_modified)) != NULL)
+    {
+        logdebug("Loaded the translations of %s for locale '%s' from the disk cache\n",
+                 p->name, locale ? locale : "");
+        if (strings_uri)
+            revalidate_translations(b, caps->uri, locale, strings_uri, last_modified);
+    }
+    else
+    {
+        translations = build_printer_translations(p, caps, locale);
+        catalog = get_printer_catalog(p);
+
+        /** Without the printer's strings file they're only good for this
+         * reply; the download is tried again for the next one **/
+        g_rec_mutex_lock(&p->lock);
+        complete = catalog != NULL || printer_strings_uri(p) == NULL;
+
+        /** Built from the loaded media only, they'd miss the choices of the
+         * full media list under the same change time, so keep them in
+         * memory only, until the full options replace caps **/
+        if (complete && !caps->ready_media_only)
+            store_translations_on_disk(caps->uri, locale, caps->config_change_time,
+                                       printer_strings_uri(p),
+                                       catalog ? catalog->last_modified : NULL,
+                                       translations);
+        g_rec_mutex_unlock(&p->lock);
+    }
+
+    /** Keep the finished reply for the next dialog asking in this locale **/
+    if (complete)
+        g_hash_table_insert(caps->translations, cpdbGetStringCopy(locale ? locale : ""),
+                            g_variant_ref(translations));
+    unref_PrinterCapabilities(caps);
 
     return translations;
 }
@@ -2034,3 +4460,226 @@ void free_string(char *str)
         free(str);
     }
 }
+
+/**************String pool*********************************/
+/**
+ * Option keywords, group names and the like repeat across every printer
+ * and every GetAllOptions call, so they are kept once in a process-wide
+ * pool instead of being copied per printer.
+ * Interned strings are never freed, so only a fixed vocabulary belongs
+ * here; printer names and the values printers report are copied.
+ * They may be shared between threads.
+ */
+static GMutex string_pool_lock;
+static GHashTable *string_pool = NULL;
+static gsize string_pool_bytes = 0;
+static gsize string_pool_bytes_saved = 0;
+
+const char *intern_string(const char *str)
+{
+    char *interned;
+
+    if (str == NULL)
+        return NULL;
+
+    g_mutex_lock(&string_pool_lock);
+    if (string_pool == NULL)
+        string_pool = g_hash_table_new(g_str_hash, g_str_equal);
+
+    interned = g_hash_table_lookup(string_pool, str);
+    if (interned)
+    {
+        string_pool_bytes_saved += strlen(str) + 1;
+    }
+    else
+    {
+        interned = cpdbGetStringCopy(str);
+        g_hash_table_add(string_pool, interned);
+        string_pool_bytes += strlen(str) + 1;
+    }
+    g_mutex_unlock(&string_pool_lock);
+
+    return interned;
+}
+
+void log_string_pool_stats()
+{
+    g_mutex_lock(&string_pool_lock);
+    loginfo("String pool: %u strings, %lu bytes, %lu bytes saved\n",
+            string_pool ? g_hash_table_size(string_pool) : 0,
+            (unsigned long)string_pool_bytes,
+            (unsigned long)string_pool_bytes_saved);
+    g_mutex_unlock(&string_pool_lock);
+}
+
+/**************Arena allocator*****************************/
+/**
+ * Reading a printer's options makes hundreds of small allocations which
+ * all live exactly as long as its capabilities. They are carved out of
+ * ARENA_BLOCK_SIZE blocks instead; larger ones get a block of their own.
+ * An arena is used by one thread at a time.
+ */
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+typedef struct _ArenaBlock
+{
+    struct _ArenaBlock *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+#define ARENA_BLOCK_DATA(block) ((char *)(block) + ARENA_ALIGN(sizeof(ArenaBlock)))
+
+struct _Arena
+{
+    ArenaBlock *blocks;     /** the one being filled first **/
+    unsigned num_allocs;
+    unsigned num_blocks;
+    size_t bytes;
+};
+
+static ArenaBlock *arena_new_block(Arena *a, size_t size)
+{
+    ArenaBlock *block = malloc(ARENA_ALIGN(sizeof(ArenaBlock)) + size);
+
+    block->size = size;
+    block->used = 0;
+    a->num_blocks++;
+    return block;
+}
+
+Arena *arena_new()
+{
+    return (Arena *)calloc(1, sizeof(Arena));
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+    ArenaBlock *block = a->blocks;
+    void *ptr;
+
+    size = ARENA_ALIGN(size);
+    a->num_allocs++;
+    a->bytes += size;
+
+    if (size > ARENA_BLOCK_SIZE / 4)
+    {
+        /** Keep filling the current block after this one **/
+        block = arena_new_block(a, size);
+        if (a->blocks)
+        {
+            block->next = a->blocks->next;
+            a->blocks->next = block;
+        }
+        else
+        {
+            block->next = NULL;
+            a->blocks = block;
+        }
+    }
+    else if (block == NULL || block->used + size > block->size)
+    {
+        block = arena_new_block(a, ARENA_BLOCK_SIZE);
+        block->next = a->blocks;
+        a->blocks = block;
+    }
+
+    ptr = ARENA_BLOCK_DATA(block) + block->used;
+    block->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char *arena_strdup(Arena *a, const char *str)
+{
+    size_t len;
+    char *copy;
+
+    if (str == NULL)
+        return NULL;
+
+    len = strlen(str) + 1;
+    copy = arena_alloc(a, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_free(Arena *a)
+{
+    ArenaBlock *block, *next;
+
+    if (a == NULL)
+        return;
+
+    for (block = a->blocks; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    free(a);
+}
+
+void log_arena_stats(const Arena *a, const char *what, const char *printer_name)
+{
+    logdebug("%s of %s: %u allocations from %u blocks, %lu bytes\n",
+             what, printer_name, a->num_allocs, a->num_blocks,
+             (unsigned long)a->bytes);
+}
+
+/**************IPP keyword registry************************/
+const IppKeyword *lookup_ipp_keyword(const char *keyword)
+{
+    if (keyword == NULL)
+        return NULL;
+    return ipp_keyword_lookup(keyword, strlen(keyword));
+}
+
+unsigned ipp_keyword_flags(const char *keyword)
+{
+    const IppKeyword *kw = lookup_ipp_keyword(keyword);
+    return kw ? kw->flags : 0;
+}
+
+/**
+ * cpdbGetGroup() walks its own list of keywords and allocates the result,
+ * so remember its answer: per keyword ID for the registered keywords and
+ * by name for the rest.
+ */
+static GMutex option_group_lock;
+static const char *option_groups[KW_COUNT];
+static GHashTable *other_option_groups = NULL;
+
+const char *get_option_group(const char *option_name)
+{
+    const IppKeyword *kw = lookup_ipp_keyword(option_name);
+    const char *group;
+    char *name;
+
+    g_mutex_lock(&option_group_lock);
+    if (kw)
+    {
+        group = option_groups[kw->id];
+    }
+    else
+    {
+        if (other_option_groups == NULL)
+            other_option_groups = g_hash_table_new(g_str_hash, g_str_equal);
+        group = g_hash_table_lookup(other_option_groups, option_name);
+    }
+
+    if (group == NULL)
+    {
+        name = cpdbGetGroup(option_name);
+        group = intern_string(name);
+        free(name);
+
+        if (kw)
+            option_groups[kw->id] = group;
+        else
+            g_hash_table_insert(other_option_groups, (char *)intern_string(option_name), (char *)group);
+    }
+    g_mutex_unlock(&option_group_lock);
+
+    return group;
+}
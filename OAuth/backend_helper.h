@@ -30,28 +30,114 @@
 
 #define MSG_LOG_LEVEL INFO
 
+/* Backend specific D-Bus extensions, exported next to org.openprinting.PrintBackend */
+#define CUPS_EXT_INTERFACE "org.openprinting.PrintBackend.CUPS"
+#define CUPS_SIGNAL_PRINTERS_ADDED "PrintersAdded"
+#define CUPS_SIGNAL_PRINTERS_REMOVED "PrintersRemoved"
+#define CUPS_PRINTERS_ADDED_ARGS "(a" CPDB_PRINTER_ARGS ")"
+#define CUPS_PRINTERS_REMOVED_ARGS "(a(ss))"
+
+/* How long printer additions/removals are collected before a batched signal goes out */
+#define SIGNAL_BATCH_MSEC 50
+
+/* CupsNotifier events are applied once no new one came for NOTIFIER_QUIET_MSEC,
+ * but never later than NOTIFIER_MAX_DELAY_MSEC after the first pending one */
+#define NOTIFIER_QUIET_MSEC 250
+#define NOTIFIER_MAX_DELAY_MSEC 2000
+
+/* Threads connecting to the local printers ahead of time after an enumeration
+ * and re-reading cached options; the CPDB_CUPS_WARMUP_THREADS environment
+ * variable overrides it, 0 disables the warm-up (the re-reads keep one) */
+#define WARMUP_THREADS 4
+
+/* get_printer_state() and the capabilities cache ask the printer again for its
+ * state and printer-config-change-time once the ones they know are older */
+#define PRINTER_STATE_TTL_SEC 5
+
+/* A printer's strings file that couldn't be downloaded is tried again after this */
+#define STRINGS_RETRY_SEC 30
+
+/* More pending printers than this are applied by re-enumerating once */
+#define NOTIFIER_MAX_NAMED_LOOKUPS 16
+
+/** What CupsNotifier reported about a printer since the last refresh **/
+#define PRINTER_EVENT_ADDED   (1 << 0)
+#define PRINTER_EVENT_DELETED (1 << 1)
+#define PRINTER_EVENT_MODIFIED (1 << 2)
+
+/**
+ * The printer details sent in printer lists and PrinterAdded signals,
+ * extracted once from the destination. info, location and make_and_model
+ * are copies owned by the summary; free them with free_PrinterSummary().
+ */
+typedef struct _PrinterSummary
+{
+    char *info;
+    char *location;
+    char *make_and_model;
+    const char *state;  /** static or interned **/
+    gboolean accepting_jobs;
+} PrinterSummary;
+
 /**
  * Represents a CUPS Printer
  */
 typedef struct _PrinterCUPS
 {
+    int ref_count;
     char *name;
     cups_dest_t *dest;
     http_t *http;
     cups_dinfo_t *dinfo;
     char *stream_socket_path;
+    PrinterSummary summary;
+
+    /** names of the dialogs listing this printer, so that changes to the
+     * printer only need to reach those **/
+    GHashTable *subscribers;
+
+    /** the printer attributes fetched by get_printer_attributes(), if any **/
+    ipp_t *attrs;
+    gint64 state_time;  /** monotonic time the state and config change time in attrs were last known current **/
+
+    /** media-col-database decoded by get_media_database(), if done yet **/
+    struct _MediaDatabase *media_db;
+
+    /** dest->options by name, see printer_option() **/
+    GHashTable *dest_options;
+
+    /** the answers of cupsFindDestSupported() and cupsFindDestDefault() by
+     * option name, missing ones included; see printer_supported() **/
+    GHashTable *supported_attrs;
+    GHashTable *default_attrs;
+
+    /** guards http, dinfo and attrs, which the warm-up threads use too **/
+    GRecMutex lock;
+    int warmed_up;
 } PrinterCUPS;
 
+typedef struct _EnumJob EnumJob;
+typedef struct _PrinterSnapshot PrinterSnapshot;
+
 /**
  * Represents a frontend instance that the backend is associated with
  */
 typedef struct _Dialog
 {
     int cancel;
+    PrinterSnapshot *snapshot;  /** the enumeration snapshot the printer list was last synced with **/
     gboolean hide_remote;
     gboolean hide_temp;
     GHashTable *printers;
     gboolean keep_alive;
+
+    /** the frontend understands PrintersAdded/PrintersRemoved; the
+     * additions (name -> packed printer) and removals (names) waiting for
+     * the next batch are kept until batch_source fires **/
+    gboolean batch_signals;
+    GHashTable *pending_added;
+    GHashTable *pending_removed;
+    guint batch_source;
 } Dialog;
 
 typedef struct _Mappings
@@ -75,10 +161,72 @@ typedef struct _BackendObj
     /** the hash table to map from dialog name(char*) to the Dialog struct(Dialog*) **/
     GHashTable *dialogs;
 
+    /** the registry of printers shared by all dialogs; maps from printer name(char*)
+     * to the PrinterCUPS struct(PrinterCUPS*). Each dialog only holds references. **/
+    GHashTable *printers;
+
     int num_frontends;
     char *default_printer;
+
+    /** bumped by the CupsNotifier events adding, deleting or modifying
+     * printers, outdating the enumeration snapshots **/
+    guint64 generation;
+
+    /** latest enumeration snapshot for each hide_temp/hide_remote combination **/
+    PrinterSnapshot *snapshots[4];
+
+    /** enumeration running to produce a fresh unfiltered snapshot, and the
+     * requests waiting for it **/
+    EnumJob *snapshot_job;
+    GList *snapshot_waiters;
+
+    /** printer discovery streaming to the dialogs (names) which asked for
+     * the printer list while it was queued or running **/
+    EnumJob *discovery_job;
+    GHashTable *discovery_dialogs;
+
+    /** the frontends which asked for batched printer signals **/
+    GHashTable *batch_frontends;
+
+    /** CupsNotifier events waiting for the debounce timer; maps from the
+     * printer name to its PRINTER_EVENT_* flags **/
+    GHashTable *pending_events;
+    guint debounce_source;
+    gint64 debounce_deadline;
+    guint64 events_received;
+    guint64 refreshes_run;
+
+    /** the options and media of each printer, shared by all dialogs; maps
+     * from printer-uri-supported(char*) to PrinterCapabilities* **/
+    GHashTable *capabilities;
 } BackendObj;
 
+/** Called on the main loop for each destination reported while enumerating **/
+typedef void (*EnumDestFunc)(BackendObj *b, unsigned flags, cups_dest_t *dest, gpointer user_data);
+
+/** Called on the main loop once the job's table of printers is complete **/
+typedef void (*EnumDoneFunc)(EnumJob *job);
+
+/**
+ * Represents a cupsEnumDests() run on the enumeration worker thread
+ */
+struct _EnumJob
+{
+    int ref_count;
+    int cancel;             /** set to 1 to stop the enumeration **/
+    BackendObj *b;
+    guint64 generation;     /** the backend's generation when the job was queued **/
+    int msec;
+    unsigned type;
+    unsigned mask;
+    gboolean notemp;
+    GHashTable *printers;   /** printer name(char*) -> cups_dest_t*, filled by the worker thread **/
+    EnumDestFunc dest_cb;
+    EnumDoneFunc done_cb;
+    gpointer user_data;
+    GDestroyNotify user_data_free;
+};
+
 /**
  * Represents a single 'option' for a printer
  */
@@ -102,6 +250,49 @@ typedef struct _Media
 	int (*margins)[4]; /** int margins[num_margins][4]; left(0), right(1), top(2), bottom(3) **/
 } Media;
 
+/**
+ * The media sizes of a printer's media-col-database, each with its distinct
+ * margins, sorted by name. Allocated in one block; shared and read-only.
+ */
+typedef struct _MediaDatabase
+{
+    int ref_count;
+    int num_media;
+    Media *media;
+} MediaDatabase;
+
+/**
+ * Bump allocator the options and media of a printer are built in, so that
+ * they take a few large blocks and are freed at once; see arena_new()
+ */
+typedef struct _Arena Arena;
+
+/**
+ * The options and media sizes read from a printer, cached per printer URI
+ * and shared by all dialogs. Read-only once built.
+ */
+typedef struct _PrinterCapabilities
+{
+    int ref_count;
+    char *uri;
+    char *printer_name;
+    char *config_change_time;       /** printer-config-change-time they were read at, if known **/
+    int num_options;
+    Option *options;                /** includes the media options **/
+    int num_media;
+    Media *media;
+    GVariant *serialized;           /** the mapped disk cache the strings point into, if loaded from there **/
+    Arena *arena;                   /** everything options and media point to otherwise **/
+    MediaDatabase *media_db;        /** what media points into, unless loaded from the disk cache **/
+    gboolean ready_media_only;      /** media lists the loaded media only, the rest is being read **/
+    gboolean dropped;               /** invalidated, so not to be installed or stored again **/
+
+    /** the packed replies, built on first use on the main loop **/
+    GVariant *options_reply;
+    GVariant *media_reply;
+    GHashTable *translations;       /** locale -> GetAllTranslations reply **/
+} PrinterCapabilities;
+
 /*
 typedef struct _PrintResult
 {
@@ -111,7 +302,10 @@ typedef struct _PrintResult
 */
 
 typedef struct _PrintDataThreadData {
-    PrinterCUPS *printer;
+    /** the job's own connection, see print_socket() **/
+    http_t *http;
+    cups_dest_t *dest;
+    cups_dinfo_t *dinfo;
     int num_options;
     cups_option_t *options;
     int socket_fd;
@@ -171,6 +365,62 @@ void set_hide_temp_printers(BackendObj *, const char *dialog_name);
 /** Unhides temporary CUPS queues for the dialog **/
 void unset_hide_temp_printers(BackendObj *, const char *dialog_name);
 
+/**
+ * Enumerate the CUPS destinations on the enumeration worker thread, so that
+ * the main loop keeps serving D-Bus requests in the meantime. Both callbacks
+ * (either may be NULL) are invoked on the main loop, unless the job gets
+ * cancelled first.
+ *
+ * Returns a reference to the job, to be released with unref_EnumJob()
+ */
+EnumJob *enumerate_printers_async(BackendObj *b, int msec, gboolean notemp, gboolean noremote,
+                                  EnumDestFunc dest_cb, EnumDoneFunc done_cb,
+                                  gpointer user_data, GDestroyNotify user_data_free);
+void cancel_EnumJob(EnumJob *job);
+EnumJob *ref_EnumJob(EnumJob *job);
+void unref_EnumJob(EnumJob *job);
+
+/**
+ * Represents an immutable result of enumerating the CUPS destinations,
+ * shared by all the dialogs with the same hide_temp/hide_remote settings
+ */
+struct _PrinterSnapshot
+{
+    int ref_count;
+    guint64 generation;
+    gboolean hide_temp;
+    gboolean hide_remote;
+    GHashTable *printers;       /** printer name(char*) -> cups_dest_t* **/
+    PrinterSnapshot *base;      /** the unfiltered snapshot this one was derived from, if any **/
+};
+
+typedef void (*SnapshotFunc)(BackendObj *b, PrinterSnapshot *snapshot, gpointer user_data);
+
+/**
+ * Calls func with the current snapshot for the given filter settings.
+ * This happens right away if the cached snapshot is still up to date with
+ * the backend's generation, otherwise once a single shared enumeration
+ * has finished on the worker thread. An enumeration outdated while it runs
+ * still finishes for the requests made before; the later ones wait for the
+ * next.
+ */
+void get_printer_snapshot(BackendObj *b, gboolean hide_temp, gboolean hide_remote,
+                          SnapshotFunc func, gpointer user_data, GDestroyNotify user_data_free);
+
+/**
+ * Keeps the table of a finished unfiltered enumeration job as the unfiltered snapshot
+ * of the job's generation.
+ *
+ * Returns a new reference to the snapshot
+ */
+PrinterSnapshot *store_base_snapshot(EnumJob *job);
+
+/** Outdate all the cached snapshots, because CUPS reported a change **/
+void invalidate_printer_snapshots(BackendObj *b);
+
+PrinterSnapshot *ref_PrinterSnapshot(PrinterSnapshot *s);
+void unref_PrinterSnapshot(PrinterSnapshot *s);
+
 /** Utility functions for subscribing to CUPS for notifications*/
 int create_subscription ();
 gboolean renew_subscription (int id);
@@ -198,14 +448,94 @@ PrinterCUPS *add_printer_to_dialog(BackendObj *, const char *dialog_name, const
  */
 void remove_printer_from_dialog(BackendObj *, const char *dialog_name, const char *printer_name);
 
+/**
+ * Returns a new reference to the registry's PrinterCUPS for this destination,
+ * creating and registering it if no dialog is using the printer yet.
+ */
+PrinterCUPS *acquire_printer(BackendObj *, const cups_dest_t *dest);
+
+/**
+ * Drops the printer from the registry if no dialog lists it anymore
+ */
+void release_printer(BackendObj *, const char *printer_name);
+
+/** Drops all the printers from the registry which aren't used by any dialog **/
+void prune_printer_registry(BackendObj *);
+
 void send_printer_state_changed_signal(BackendObj *b, const char *dialog_name, const char *printer_name,
                                         const char *printer_state, gboolean printer_is_accepting_jobs);
-void send_printer_added_signal(BackendObj *b, const char *dialog_name, cups_dest_t *dest);
+void send_printer_added_signal(BackendObj *b, const char *dialog_name, PrinterCUPS *p);
 void send_printer_removed_signal(BackendObj *b, const char *dialog_name, const char *printer_name);
+
+/**
+ * Makes the dialog receive PrintersAdded/PrintersRemoved signals, which
+ * collect the additions and removals of SIGNAL_BATCH_MSEC, instead of one
+ * signal per printer
+ */
+void enable_batched_signals(BackendObj *b, const char *dialog_name);
+
+/** Sends the pending batched signals of the dialog right away **/
+void flush_printer_signals(BackendObj *b, const char *dialog_name);
 void notify_removed_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void notify_added_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void replace_printers(BackendObj *b, const char *dialog_name, GHashTable *new_table);
 void refresh_printer_list(BackendObj *b, char *dialog_name);
+
+/**
+ * Re-enumerates the CUPS destinations once and updates the printer
+ * lists of all dialogs from that single result
+ */
+void refresh_all_printer_lists(BackendObj *b);
+
+/**
+ * Apply a single printer addition/removal reported by the CUPS notifier
+ * to the printer lists of all the dialogs, without re-enumerating.
+ *
+ * Returns FALSE if the printer couldn't be looked up, in which case the
+ * caller should fall back to refresh_all_printer_lists()
+ */
+gboolean add_printer_to_dialogs(BackendObj *b, const char *printer_name);
+void remove_printer_from_dialogs(BackendObj *b, const char *printer_name);
+
+/**
+ * Apply a printer state change reported by the CUPS notifier to the
+ * dialogs listing the printer, using the reported state as is.
+ *
+ * Returns FALSE if no dialog knows the printer yet
+ */
+gboolean update_printer_state(BackendObj *b, const char *printer_name,
+                              guint printer_state, gboolean printer_is_accepting_jobs);
+
+/**
+ * Re-read the destination of a modified printer, so that its summary and
+ * options reflect the new settings, and tell the dialogs listing it
+ * about its state.
+ */
+void refresh_printer(BackendObj *b, const char *printer_name);
+
+/**
+ * Record a CupsNotifier event (PRINTER_EVENT_*) for the printer. The pending
+ * events are applied together once the notifier has been quiet for
+ * NOTIFIER_QUIET_MSEC, or NOTIFIER_MAX_DELAY_MSEC after the first one.
+ */
+void queue_printer_event(BackendObj *b, const char *printer_name, int event);
+
+/** Apply the pending CupsNotifier events right away **/
+void flush_printer_events(BackendObj *b);
+
+/**
+ * Brings the dialog's printer list up to date. If no change came since the
+ * last enumeration, that snapshot is applied right away. Otherwise the
+ * dialog joins the discovery already queued or running, or queues one;
+ * it enumerates the CUPS destinations on the worker thread, sending a
+ * PrinterAdded signal to each dialog for each printer as soon as it is
+ * found. Setting the dialog's cancel flag (done when it goes away) leaves
+ * the discovery, which stops once no dialog is left.
+ */
+void start_printer_discovery(BackendObj *b, const char *dialog_name);
+
+/** Returns whether the dialog's hide_temp/hide_remote settings allow showing this printer **/
+gboolean dialog_accepts_printer(Dialog *d, cups_dest_t *dest);
 GHashTable *get_dialog_printers(BackendObj *b, const char *dialog_name);
 cups_dest_t *get_dest_by_name(BackendObj *b, const char *dialog_name, const char *printer_name);
 PrinterCUPS *get_printer_by_name(BackendObj *b, const char *dialog_name, const char *printer_name);
@@ -218,22 +548,111 @@ PrinterCUPS *get_new_PrinterCUPS(const cups_dest_t *dest);
 /** Free up the memory used by the struct **/
 void free_PrinterCUPS(PrinterCUPS *);
 
+/** Extract the details shown in printer lists from the printer's destination **/
+void fill_PrinterSummary(PrinterSummary *s, PrinterCUPS *p);
+void free_PrinterSummary(PrinterSummary *s);
+
+/** Pack the printer's summary into a CPDB_PRINTER_ARGS tuple **/
+GVariant *pack_printer_summary(const PrinterCUPS *p);
+
+/** Reference counting for the PrinterCUPS struct shared among dialogs **/
+PrinterCUPS *ref_PrinterCUPS(PrinterCUPS *);
+void unref_PrinterCUPS(PrinterCUPS *);
+
 /** Ensure that we have a connection the server**/
 gboolean ensure_printer_connection(PrinterCUPS *p);
 
+/**
+ * The value of the destination option, looked up in the printer's
+ * option index; NULL if the destination has no such option
+ */
+const char *printer_option(PrinterCUPS *p, const char *option_name);
+
+/**
+ * cupsFindDestSupported() and cupsFindDestDefault() for the printer,
+ * connecting to it if needed. Each option is looked up in the dest info
+ * once, later calls are answered from the printer's index.
+ */
+ipp_attribute_t *printer_supported(PrinterCUPS *p, const char *option_name);
+ipp_attribute_t *printer_default(PrinterCUPS *p, const char *option_name);
+
+/** cups_printer_state() and friends, answered from the printer's option index **/
+const char *printer_dest_state(PrinterCUPS *p);
+gboolean printer_accepts_jobs(PrinterCUPS *p);
+gboolean printer_is_temporary(PrinterCUPS *p);
+gboolean printer_is_remote(PrinterCUPS *p);
+
 /**
  * Get state of the printer
  * state is one of the following {"idle" , "processing" , "stopped"}
  */
 const char *get_printer_state(PrinterCUPS *p);
+
+/**
+ * The attributes of the printer which the backend uses (state, strings
+ * URI, ready media, job creation attributes, config change time), fetched
+ * with one Get-Printer-Attributes request on first use. The media database
+ * is left to get_media_database(). Owned by the printer, and may be
+ * dropped by forget_printer_attributes() at any time, so hold p->lock while
+ * using them; NULL if the request failed.
+ */
+ipp_t *get_printer_attributes(PrinterCUPS *p);
+
+/** Drop the fetched attributes, so that the next use asks the printer again **/
+void forget_printer_attributes(PrinterCUPS *p);
+
+/**
+ * Connect to the local printers among the given ones (name -> PrinterCUPS)
+ * and fetch their dest info and attributes on the warm-up threads
+ */
+void warm_up_printers(BackendObj *b, GHashTable *printers);
 char *get_orientation_default(PrinterCUPS *p);
 char *get_default(PrinterCUPS *p, char *option_name);
 int get_supported(PrinterCUPS *p, char ***supported_values, const char *option_name);
 int get_job_creation_attributes(PrinterCUPS *p, char ***values);
 
-int get_all_options(PrinterCUPS *p, Option **options);
-int get_all_media(PrinterCUPS *p, Media **medias);
-int add_media_to_options(PrinterCUPS *p, Media *medias, int media_count, Option **options, int count);
+/**
+ * The default value of the option, borrowed from the printer or formatted
+ * into buf (IPP_VALUE_BUFSIZE bytes); "NA" if it has none
+ */
+const char *lookup_default(PrinterCUPS *p, const char *option_name, char *buf, size_t bufsize);
+
+/**
+ * Read the options of the printer. The options and everything they point
+ * to are allocated from the arena, with room left for add_media_to_options().
+ */
+int get_all_options(PrinterCUPS *p, Arena *a, Option **options);
+
+/**
+ * Like get_all_options() with the media options added, but leaving out
+ * the supported values of the options, which take most of the time
+ */
+int get_option_defaults(PrinterCUPS *p, Arena *a, Option **options);
+
+/**
+ * The supported values of one option, as get_all_options() and
+ * add_media_to_options() would list them, asking the printer for that
+ * option only. The values are allocated from the arena.
+ *
+ * Returns -1 if the printer has no such option
+ */
+int get_option_choices(PrinterCUPS *p, Arena *a, const char *option_name, char ***choices);
+/**
+ * The printer's media sizes, decoded from its attributes on first use and
+ * kept with the printer; NULL if they couldn't be fetched. Unref when done.
+ */
+MediaDatabase *get_media_database(PrinterCUPS *p);
+
+/**
+ * The media loaded in the printer, from media-col-ready or media-ready;
+ * NULL if it reports none. Unref when done.
+ */
+MediaDatabase *get_ready_media(PrinterCUPS *p);
+MediaDatabase *ref_MediaDatabase(MediaDatabase *db);
+void unref_MediaDatabase(MediaDatabase *db);
+/** Append the media options; custom_sizes adds custom_min/custom_max from the supported media **/
+int add_media_to_options(PrinterCUPS *p, Arena *a, Media *medias, int media_count,
+                         gboolean custom_sizes, Option **options, int count);
 
 static void *print_data_thread(void *data);
 void print_socket(PrinterCUPS *p, int num_settings, GVariant *settings, char *job_id_str, char *socket_path, const char *title);
@@ -252,9 +671,17 @@ char *get_choice_translation(PrinterCUPS *p, const char *option_name,
                              const char *choice_name, const char *locale);
 
 /**
- * Get translations for all printer strings
+ * Drop the parsed strings file of the printer, so that the next
+ * translation downloads it again
+ */
+void forget_printer_catalog(PrinterCUPS *p);
+
+/**
+ * Get translations for all printer strings. The reply is kept with the
+ * printer's capabilities for each locale, and on disk until the printer's
+ * strings file changes; unref it when done.
  */
-GVariant *get_printer_translations(PrinterCUPS *p, const char *locale);
+GVariant *get_printer_translations(BackendObj *b, PrinterCUPS *p, const char *locale);
 
 
 void tryPPD(PrinterCUPS *p);
@@ -264,9 +691,38 @@ void free_Dialog(Dialog *);
 
 /*********Option related functions*****************/
 void print_option(const Option *opt);
-void free_options(int count, Option *opts);
+
+/*********PrinterCapabilities related functions*********/
+/**
+ * Get the options and media of the printer, from the cache if they were
+ * read before and the printer's configuration didn't change since.
+ * Unref the returned value when done.
+ */
+PrinterCapabilities *get_printer_capabilities(BackendObj *b, PrinterCUPS *p);
+
+/** Like get_printer_capabilities(), but NULL unless they are cached in memory **/
+PrinterCapabilities *peek_printer_capabilities(BackendObj *b, PrinterCUPS *p);
+
+/** The option of the given name among the capabilities, or NULL **/
+const Option *find_option(PrinterCapabilities *c, const char *option_name);
+
+/** Forget the cached options of the printer, because CUPS reported a change **/
+void invalidate_printer_capabilities(BackendObj *b, const char *printer_name);
+
+/**
+ * The packed a(sssia(s)) options and a(siiia(iiii)) media of the printer,
+ * as sent in GetAllOptions replies; owned by the capabilities
+ */
+GVariant *get_options_reply(PrinterCapabilities *c);
+GVariant *get_media_reply(PrinterCapabilities *c);
+
+PrinterCapabilities *ref_PrinterCapabilities(PrinterCapabilities *c);
+void unref_PrinterCapabilities(PrinterCapabilities *c);
 void unpack_option_array(GVariant *var, int num_options, Option **options);
 GVariant *pack_option(const Option *opt);
+
+/** Pack the option's name, group and default value only **/
+GVariant *pack_option_default(const Option *opt);
 GVariant *pack_media(const Media *media);
 /**********Mapping related functions*****************/
 Mappings *get_new_Mappings();
@@ -275,11 +731,18 @@ Mappings *get_new_Mappings();
 const char *cups_printer_state(cups_dest_t *dest);
 gboolean cups_is_accepting_jobs(cups_dest_t *dest);
 void cups_get_Resolution(cups_dest_t *dest, int *xres, int *yres);
-GHashTable *cups_get_all_printers();
-GHashTable *cups_get_local_printers();
 char *cups_retrieve_string(cups_dest_t *dest, const char *option_name);
 gboolean cups_is_temporary(cups_dest_t *dest);
-GHashTable *cups_get_printers(gboolean notemp, gboolean noremote);
+gboolean cups_is_remote(cups_dest_t *dest);
+/** Big enough for any value format_ipp_value() formats **/
+#define IPP_VALUE_BUFSIZE 64
+
+/**
+ * The value as a string, either borrowed from attr or the IPP enum tables
+ * or formatted into buf; copy it before the next IPP call
+ */
+const char *format_ipp_value(ipp_attribute_t *attr, int index, const char *option_name,
+                             char *buf, size_t bufsize);
 char *extract_ipp_attribute(ipp_attribute_t *, int index, const char *option_name);
 char *extract_res_from_ipp(ipp_attribute_t *, int index);
 char *extract_string_from_ipp(ipp_attribute_t *attr, int index);
@@ -294,4 +757,85 @@ char *translate_job_state(ipp_jstate_t);
 void MSG_LOG(const char *msg, int msg_level);
 void free_string(char *);
 void free_string_array(int count, char **arr);
+
+/**************String pool*********************************/
+/**
+ * Return the pooled copy of str; the result must not be freed
+ */
+const char *intern_string(const char *str);
+void log_string_pool_stats();
+
+/**************Arena allocator*****************************/
+Arena *arena_new();
+
+/** Zeroed memory aligned for any type, valid until arena_free() **/
+void *arena_alloc(Arena *a, size_t size);
+char *arena_strdup(Arena *a, const char *str);
+void arena_free(Arena *a);
+
+/** Log how many allocations the arena served from how many blocks **/
+void log_arena_stats(const Arena *a, const char *what, const char *printer_name);
+
+/**************IPP keyword registry************************/
+/**
+ * IDs of the IPP keywords listed in ipp-keywords.gperf
+ */
+typedef enum _IppKeywordId
+{
+    KW_BOOKLET,
+    KW_IPP_ATTRIBUTE_FIDELITY,
+    KW_JOB_SHEETS,
+    KW_MEDIA,
+    KW_MEDIA_COL,
+    KW_MIRROR,
+    KW_MULTIPLE_DOCUMENT_HANDLING,
+    KW_NUMBER_UP,
+    KW_NUMBER_UP_LAYOUT,
+    KW_ORIENTATION_REQUESTED,
+    KW_PAGE_BORDER,
+    KW_PAGE_DELIVERY,
+    KW_PAGE_SET,
+    KW_POSITION,
+    KW_PRINT_SCALING,
+    KW_BILLING_INFO,
+    KW_COPIES,
+    KW_FINISHINGS,
+    KW_JOB_HOLD_UNTIL,
+    KW_JOB_NAME,
+    KW_JOB_PRIORITY,
+    KW_MEDIA_SOURCE,
+    KW_MEDIA_TYPE,
+    KW_MEDIA_TOP_MARGIN,
+    KW_MEDIA_BOTTOM_MARGIN,
+    KW_MEDIA_LEFT_MARGIN,
+    KW_MEDIA_RIGHT_MARGIN,
+    KW_OUTPUT_BIN,
+    KW_PAGE_RANGES,
+    KW_PRINT_COLOR_MODE,
+    KW_PRINT_QUALITY,
+    KW_PRINTER_RESOLUTION,
+    KW_SIDES,
+    KW_COUNT
+} IppKeywordId;
+
+/** Keyword flags **/
+#define KW_HARDCODED            (1 << 0)    /** option built by the backend itself, not asked from the printer **/
+#define KW_ORIENTATION          (1 << 1)    /** orientation-requested, reported as enum but handled by keyword **/
+#define KW_PRINT_QUALITY_OPTION (1 << 2)    /** choices reported as keywords which map to enum values, see map_print_quality() **/
+
+typedef struct ipp_keyword
+{
+    const char *name;
+    int id;                     /** IppKeywordId **/
+    unsigned flags;
+} IppKeyword;
+
+/** Returns NULL for keywords without special treatment **/
+const IppKeyword *lookup_ipp_keyword(const char *keyword);
+unsigned ipp_keyword_flags(const char *keyword);
+
+/**
+ * The cpdb option group of the option; the result is interned
+ */
+const char *get_option_group(const char *option_name);
 #endif
@@ -16,6 +16,7 @@
 // Function declarations
 static void on_name_acquired(GDBusConnection *connection, const gchar *name, gpointer not_used);
 static void acquire_session_bus_name(char *bus_name);
+static void export_cups_extensions(GDBusConnection *connection);
 gpointer list_printers(gpointer _dialog_name);
 int send_printer_added(void *_dialog_name, unsigned flags, cups_dest_t *dest);
 void connect_to_signals();
@@ -23,36 +24,21 @@ void init_authentication();  // Add function for initializing authentication
 
 BackendObj *b;
 
-void update_printer_lists()
-{
-    GHashTableIter iter;
-    gpointer key, value;
-
-    g_hash_table_iter_init(&iter, b->dialogs);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        char *dialog_name = key;
-        refresh_printer_list(b, dialog_name);
-    }
-}
-
 static void on_printer_state_changed (CupsNotifier *object, const gchar *text, const gchar *printer_uri,
                                        const gchar *printer, guint printer_state, const gchar *printer_state_reasons,
                                        gboolean printer_is_accepting_jobs, gpointer user_data)
 {
     loginfo("Printer state change on printer %s: %s\n", printer, text);
 
-    GHashTableIter iter;
-    gpointer key, value;
+    /** The snapshots tell which printers there are, so this doesn't outdate
+     * them; the summaries of the printers the dialogs list are updated **/
+    if (update_printer_state(b, printer, printer_state, printer_is_accepting_jobs))
+        return;
 
-    g_hash_table_iter_init(&iter, b->dialogs);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        const char *dialog_name = key;
-        PrinterCUPS *p = get_printer_by_name(b, dialog_name, printer);
-        const char *state = get_printer_state(p);
-        send_printer_state_changed_signal(b, dialog_name, printer, state, printer_is_accepting_jobs);
-    }
+    /** A state change of a printer the backend doesn't know of yet only
+     * tells us that it exists, which matters only if a dialog is open **/
+    if (!g_hash_table_contains(b->printers, printer) && g_hash_table_size(b->dialogs) > 0)
+        queue_printer_event(b, printer, PRINTER_EVENT_ADDED);
 }
 
 static void on_printer_added (CupsNotifier *object, const gchar *text, const gchar *printer_uri, const gchar *printer,
@@ -60,7 +46,7 @@ static void on_printer_added (CupsNotifier *object, const gchar *text, const gch
                               gpointer user_data)
 {
     loginfo("Printer added: %s\n", text);
-    update_printer_lists();
+    queue_printer_event(b, printer, PRINTER_EVENT_ADDED);
 }
 
 static void on_printer_deleted (CupsNotifier *object, const gchar *text, const gchar *printer_uri, const gchar *printer,
@@ -68,7 +54,16 @@ static void on_printer_deleted (CupsNotifier *object, const gchar *text, const g
                                 gpointer user_data)
 {
     loginfo("Printer deleted: %s\n", text);
-    update_printer_lists();
+    queue_printer_event(b, printer, PRINTER_EVENT_DELETED);
+}
+
+static void on_printer_modified (CupsNotifier *object, const gchar *text, const gchar *printer_uri, const gchar *printer,
+                                 guint printer_state, const gchar *printer_state_reasons, gboolean printer_is_accepting_jobs,
+                                 gpointer user_data)
+{
+    loginfo("Printer modified: %s\n", text);
+    invalidate_printer_capabilities(b, printer);
+    queue_printer_event(b, printer, PRINTER_EVENT_MODIFIED);
 }
 
 int main()
@@ -98,9 +93,12 @@ int main()
 
     if (cups_notifier != NULL)
     {
-        g_signal_connect(cups_notifier, "printer-state-changed", G_CALLBACK(on_printer_deleted), NULL);
+        g_signal_connect(cups_notifier, "printer-state-changed", G_CALLBACK(on_printer_state_changed), NULL);
         g_signal_connect(cups_notifier, "printer-deleted", G_CALLBACK(on_printer_deleted), NULL);
         g_signal_connect(cups_notifier, "printer-added", G_CALLBACK(on_printer_added), NULL);
+        g_signal_connect(cups_notifier, "printer-modified", G_CALLBACK(on_printer_modified), NULL);
+        g_signal_connect(cups_notifier, "printer-media-changed", G_CALLBACK(on_printer_modified), NULL);
+        g_signal_connect(cups_notifier, "printer-finishings-changed", G_CALLBACK(on_printer_modified), NULL);
     }
 
     GMainLoop *loop = g_main_loop_new(NULL, FALSE);
@@ -127,58 +125,69 @@ static void on_name_acquired(GDBusConnection *connection, const gchar *name, gpo
     b->skeleton = print_backend_skeleton_new();
     connect_to_signals();
     connect_to_dbus(b, CPDB_BACKEND_OBJ_PATH);
+    export_cups_extensions(connection);
 }
 
 static gboolean on_handle_get_printer_list(PrintBackend *interface, GDBusMethodInvocation *invocation, gpointer user_data)
 {
-    int num_printers;
+    int num_printers = 0;
     GHashTableIter iter;
     gpointer key, value;
     GVariantBuilder builder;
     GVariant *printer, *printers;
 
-    cups_dest_t *dest;
-    gboolean accepting_jobs;
-    const char *state;
-    char *name, *info, *location, *make;
+    PrinterCUPS *p;
 
-    GHashTable *table = cups_get_all_printers();
     const char *dialog_name = g_dbus_method_invocation_get_sender(invocation);
 
     add_frontend(b, dialog_name);
-    num_printers = g_hash_table_size(table);
-    if (num_printers == 0)
+
+    /** Answer right away with the printers we already know of, from the
+     * latest enumeration snapshot if no change came since and the printers
+     * other dialogs use; the ones found by the enumeration are streamed as
+     * PrinterAdded signals **/
+    if (b->snapshots[0] && b->snapshots[0]->generation == b->generation)
     {
-        printers = g_variant_new_array(G_VARIANT_TYPE ("(v)"), NULL, 0);
-        print_backend_complete_get_printer_list(interface, invocation, 0, printers);
-        return TRUE;
+        g_hash_table_iter_init(&iter, b->snapshots[0]->printers);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            add_printer_to_dialog(b, dialog_name, value);
     }
 
-    g_hash_table_iter_init(&iter, table);
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
+    g_hash_table_iter_init(&iter, b->printers);
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(v)"));
     while (g_hash_table_iter_next(&iter, &key, &value))
     {
-        name = key;
-        dest = value;
-        loginfo("Found printer : %s\n", name);
-        info = cups_retrieve_string(dest, "printer-info");
-        location = cups_retrieve_string(dest, "printer-location");
-        make = cups_retrieve_string(dest, "printer-make-and-model");
-        accepting_jobs = cups_is_accepting_jobs(dest);
-        state = cups_printer_state(dest);
-        add_printer_to_dialog(b, dialog_name, dest);
-        printer = g_variant_new(CPDB_PRINTER_ARGS, dest->name, dest->name, info, location, make, accepting_jobs, state, BACKEND_NAME);
+        p = value;
+        loginfo("Known printer : %s\n", p->name);
+        if (!dialog_contains_printer(b, dialog_name, p->name))
+            add_printer_to_dialog(b, dialog_name, p->dest);
+        printer = pack_printer_summary(p);
         g_variant_builder_add(&builder, "(v)", printer);
-        free(key);
-        cupsFreeDests(1, value);
-        free(info);
-        free(location);
-        free(make);
+        num_printers++;
     }
-    g_hash_table_destroy(table);
     printers = g_variant_builder_end(&builder);
 
     print_backend_complete_get_printer_list(interface, invocation, num_printers, printers);
+
+    start_printer_discovery(b, dialog_name);
+    return TRUE;
+}
+
+static gboolean on_handle_get_all_options(PrintBackend *interface, GDBusMethodInvocation *invocation, const gchar *printer_name, gpointer user_data)
+{
+    PrinterCUPS *p;
+    PrinterCapabilities *caps;
+    const char *dialog_name;
+
+    dialog_name = g_dbus_method_invocation_get_sender(invocation);
+    p = get_printer_by_name(b, dialog_name, printer_name);
+
+    /** Read from the printer and packed only the first time any dialog asks **/
+    caps = get_printer_capabilities(b, p);
+    print_backend_complete_get_all_options(interface, invocation,
+                                           caps->num_options, get_options_reply(caps),
+                                           caps->num_media, get_media_reply(caps));
+    unref_PrinterCapabilities(caps);
     return TRUE;
 }
 
@@ -190,12 +199,216 @@ static gboolean on_handle_get_all_translations(PrintBackend *interface, GDBusMet
 
     dialog_name = g_dbus_method_invocation_get_sender(invocation);
     p = get_printer_by_name(b, dialog_name, printer_name);
-    translations = get_printer_translations(p, locale);
+    translations = get_printer_translations(b, p, locale);
     print_backend_complete_get_all_translations(interface, invocation, translations);
+    g_variant_unref(translations);
 
     return TRUE;
 }
 
+/**
+ * Backend specific additions to the org.openprinting.PrintBackend interface.
+ * Frontends which don't know about them keep getting the per-printer signals.
+ */
+static const gchar cups_ext_xml[] =
+    "<node>"
+    "  <interface name='" CUPS_EXT_INTERFACE "'>"
+    "    <method name='EnableBatchedSignals'/>"
+    "    <method name='GetOptionDefaults'>"
+    "      <arg name='printer_id' type='s' direction='in'/>"
+    "      <arg name='num_options' type='i' direction='out'/>"
+    "      <arg name='options' type='a(sss)' direction='out'/>"
+    "    </method>"
+    "    <method name='GetOptionChoices'>"
+    "      <arg name='printer_id' type='s' direction='in'/>"
+    "      <arg name='option_name' type='s' direction='in'/>"
+    "      <arg name='num_choices' type='i' direction='out'/>"
+    "      <arg name='choices' type='a(s)' direction='out'/>"
+    "    </method>"
+    "    <method name='GetAllMedia'>"
+    "      <arg name='printer_id' type='s' direction='in'/>"
+    "      <arg name='num_media' type='i' direction='out'/>"
+    "      <arg name='media' type='a(siiia(iiii))' direction='out'/>"
+    "    </method>"
+    "    <signal name='" CUPS_SIGNAL_PRINTERS_ADDED "'>"
+    "      <arg name='printers' type='a" CPDB_PRINTER_ARGS "'/>"
+    "    </signal>"
+    "    <signal name='" CUPS_SIGNAL_PRINTERS_REMOVED "'>"
+    "      <arg name='printers' type='a(ss)'/>"
+    "    </signal>"
+    "  </interface>"
+    "</node>";
+
+/**
+ * First phase of GetAllOptions: the names, groups and defaults of the
+ * options, without the supported values
+ */
+static void handle_get_option_defaults(GDBusMethodInvocation *invocation, const gchar *sender,
+                                       PrinterCUPS *p)
+{
+    GVariantBuilder builder;
+    PrinterCapabilities *caps;
+    Option *options;
+    Arena *arena;
+    int i, count;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sss)"));
+    if ((caps = peek_printer_capabilities(b, p)) != NULL)
+    {
+        count = caps->num_options;
+        for (i = 0; i < count; i++)
+            g_variant_builder_add_value(&builder, pack_option_default(&caps->options[i]));
+        unref_PrinterCapabilities(caps);
+    }
+    else
+    {
+        arena = arena_new();
+        count = get_option_defaults(p, arena, &options);
+        for (i = 0; i < count; i++)
+            g_variant_builder_add_value(&builder, pack_option_default(&options[i]));
+        log_arena_stats(arena, "Option defaults", p->name);
+        arena_free(arena);
+    }
+
+    g_dbus_method_invocation_return_value(invocation,
+                                          g_variant_new("(ia(sss))", count, &builder));
+}
+
+/**
+ * Second phase: the supported values of one option, when the dialog
+ * shows its control
+ */
+static void handle_get_option_choices(GDBusMethodInvocation *invocation, const gchar *sender,
+                                      PrinterCUPS *p, const gchar *option_name)
+{
+    PrinterCapabilities *caps;
+    const Option *opt;
+    char **values = NULL;
+    Arena *arena = NULL;
+    int count = -1;
+
+    /** Without cached capabilities only the option asked for is read **/
+    if ((caps = peek_printer_capabilities(b, p)) != NULL)
+    {
+        if ((opt = find_option(caps, option_name)) != NULL)
+        {
+            count = opt->num_supported;
+            values = opt->supported_values;
+        }
+    }
+    else
+    {
+        arena = arena_new();
+        count = get_option_choices(p, arena, option_name, &values);
+    }
+
+    if (count < 0)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "No option %s for printer %s", option_name, p->name);
+    }
+    else
+    {
+        GVariant *choices = cpdbPackStringArray(count, values);
+        g_dbus_method_invocation_return_value(invocation,
+                                              g_variant_new("(i@a(s))", count, choices));
+    }
+    unref_PrinterCapabilities(caps);
+    arena_free(arena);
+}
+
+/**
+ * The whole media database of the printer, for dialogs which got only the
+ * ready media from GetAllOptions and need the other sizes too
+ */
+static void handle_get_all_media(GDBusMethodInvocation *invocation, const gchar *sender,
+                                 PrinterCUPS *p)
+{
+    GVariantBuilder builder;
+    MediaDatabase *db = get_media_database(p);
+    int i, count = db ? db->num_media : 0;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(siiia(iiii))"));
+    for (i = 0; i < count; i++)
+        g_variant_builder_add_value(&builder, pack_media(&db->media[i]));
+    unref_MediaDatabase(db);
+
+    g_dbus_method_invocation_return_value(invocation,
+                                          g_variant_new("(ia(siiia(iiii)))", count, &builder));
+}
+
+static void on_cups_ext_method_call(GDBusConnection *connection, const gchar *sender,
+                                    const gchar *object_path, const gchar *interface_name,
+                                    const gchar *method_name, GVariant *parameters,
+                                    GDBusMethodInvocation *invocation, gpointer user_data)
+{
+    if (strcmp(method_name, "EnableBatchedSignals") == 0)
+    {
+        enable_batched_signals(b, sender);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+        return;
+    }
+
+    if (strcmp(method_name, "GetOptionDefaults") == 0 ||
+        strcmp(method_name, "GetOptionChoices") == 0 ||
+        strcmp(method_name, "GetAllMedia") == 0)
+    {
+        const gchar *printer_name, *option_name = NULL;
+
+        if (strcmp(method_name, "GetOptionChoices") == 0)
+            g_variant_get(parameters, "(&s&s)", &printer_name, &option_name);
+        else
+            g_variant_get(parameters, "(&s)", &printer_name);
+
+        if (!dialog_contains_printer(b, sender, printer_name))
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                  "Unknown printer %s", printer_name);
+            return;
+        }
+
+        PrinterCUPS *p = get_printer_by_name(b, sender, printer_name);
+        if (option_name)
+            handle_get_option_choices(invocation, sender, p, option_name);
+        else if (strcmp(method_name, "GetAllMedia") == 0)
+            handle_get_all_media(invocation, sender, p);
+        else
+            handle_get_option_defaults(invocation, sender, p);
+        return;
+    }
+
+    g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                          "Unknown method %s", method_name);
+}
+
+static const GDBusInterfaceVTable cups_ext_vtable = {
+    on_cups_ext_method_call,
+    NULL,
+    NULL
+};
+
+static void export_cups_extensions(GDBusConnection *connection)
+{
+    GError *error = NULL;
+    GDBusNodeInfo *info = g_dbus_node_info_new_for_xml(cups_ext_xml, &error);
+    if (error)
+    {
+        logwarn("Error parsing %s introspection data: %s\n", CUPS_EXT_INTERFACE, error->message);
+        g_error_free(error);
+        return;
+    }
+
+    g_dbus_connection_register_object(connection, CPDB_BACKEND_OBJ_PATH,
+                                      g_dbus_node_info_lookup_interface(info, CUPS_EXT_INTERFACE),
+                                      &cups_ext_vtable, NULL, NULL, &error);
+    if (error)
+    {
+        logwarn("Error exporting %s: %s\n", CUPS_EXT_INTERFACE, error->message);
+        g_error_free(error);
+    }
+    g_dbus_node_info_unref(info);
+}
+
 // Define authentication initialization function
 void init_authentication()
 {
@@ -0,0 +1,570 @@
+/**
+ * Behaviour tests of the parts of backend_helper.c which don't need a
+ * CUPS server: the media decoder, the capability disk cache, the arena,
+ * the IPP keyword lookup and the coalescing of notifier events and
+ * batched printer signals.
+ *
+ * The file includes backend_helper.c itself, so that the static helpers
+ * can be called directly.
+ */
+#include "backend_helper.c"
+
+#define A4_NAME "iso_a4_210x297mm"
+#define LETTER_NAME "na_letter_8.5x11in"
+
+static void set_margins(MediaEntry *e, int left, int right, int top, int bottom)
+{
+    e->has_margins = 1;
+    e->margins[0] = left;
+    e->margins[1] = right;
+    e->margins[2] = top;
+    e->margins[3] = bottom;
+}
+
+static void assert_margins(const Media *m, int i, int left, int right, int top, int bottom)
+{
+    g_assert_cmpint(i, <, m->num_margins);
+    g_assert_cmpint(m->margins[i][0], ==, left);
+    g_assert_cmpint(m->margins[i][1], ==, right);
+    g_assert_cmpint(m->margins[i][2], ==, top);
+    g_assert_cmpint(m->margins[i][3], ==, bottom);
+}
+
+/**************Media decoding*******************************/
+static void test_group_media_entries(void)
+{
+    const PwgSize *a4 = lookup_pwg_size(21000, 29700);
+    const PwgSize *letter = lookup_pwg_size(21590, 27940);
+    MediaEntry entries[6];
+    MediaDatabase *db;
+
+    g_assert_nonnull(a4);
+    g_assert_nonnull(letter);
+    g_assert_true(lookup_pwg_size(21000, 29700) == a4);
+
+    memset(entries, 0, sizeof(entries));
+    entries[0].size = letter;
+    set_margins(&entries[0], 635, 635, 635, 635);
+    entries[1].size = a4;
+    set_margins(&entries[1], 423, 423, 423, 423);
+    entries[2].size = a4;
+    set_margins(&entries[2], 0, 0, 0, 0);
+    entries[3].size = a4;
+    set_margins(&entries[3], 423, 423, 423, 423);
+    entries[4].size = letter;                   /** a ready size, without margins **/
+    entries[5].size = a4;
+    set_margins(&entries[5], 0, 0, 0, 0);
+
+    db = group_media_entries(entries, G_N_ELEMENTS(entries));
+
+    /** One entry per size, sorted by name, each distinct margin once **/
+    g_assert_cmpint(db->num_media, ==, 2);
+    g_assert_cmpstr(db->media[0].name, ==, A4_NAME);
+    g_assert_cmpint(db->media[0].width, ==, 21000);
+    g_assert_cmpint(db->media[0].length, ==, 29700);
+    g_assert_cmpint(db->media[0].num_margins, ==, 2);
+    assert_margins(&db->media[0], 0, 0, 0, 0, 0);
+    assert_margins(&db->media[0], 1, 423, 423, 423, 423);
+
+    /** The size without margins doesn't count as a borderless one **/
+    g_assert_cmpstr(db->media[1].name, ==, LETTER_NAME);
+    g_assert_cmpint(db->media[1].num_margins, ==, 1);
+    assert_margins(&db->media[1], 0, 635, 635, 635, 635);
+
+    /** The margins of one size are next to each other in the block **/
+    g_assert_true(db->media[1].margins == db->media[0].margins + 2);
+    unref_MediaDatabase(db);
+
+    db = group_media_entries(entries, 0);
+    g_assert_cmpint(db->num_media, ==, 0);
+    unref_MediaDatabase(db);
+}
+
+static ipp_t *new_media_col(int width, int length, int margin)
+{
+    ipp_t *col = ippNew();
+    ipp_t *size = ippNew();
+
+    ippAddInteger(size, IPP_TAG_ZERO, IPP_TAG_INTEGER, "x-dimension", width);
+    ippAddInteger(size, IPP_TAG_ZERO, IPP_TAG_INTEGER, "y-dimension", length);
+    ippAddCollection(col, IPP_TAG_ZERO, "media-size", size);
+    ippDelete(size);
+
+    ippAddInteger(col, IPP_TAG_ZERO, IPP_TAG_INTEGER, "media-left-margin", margin);
+    ippAddInteger(col, IPP_TAG_ZERO, IPP_TAG_INTEGER, "media-right-margin", margin);
+    ippAddInteger(col, IPP_TAG_ZERO, IPP_TAG_INTEGER, "media-top-margin", margin);
+    ippAddInteger(col, IPP_TAG_ZERO, IPP_TAG_INTEGER, "media-bottom-margin", margin);
+    return col;
+}
+
+static void test_decode_media_col(void)
+{
+    static const int cols[][3] = {
+        {21590, 27940, 635},
+        {21000, 29700, 0},
+        {21000, 29700, 423},
+        {21590, 27940, 635},    /** duplicate **/
+        {20990, 29700, 423},    /** A4 too, reported a little off **/
+        {21000, 29690, 0},
+        {0, 29700, 0},          /** no width, skipped **/
+    };
+    ipp_t *attrs = ippNew();
+    ipp_attribute_t *mdb = NULL;
+    MediaDatabase *db;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(cols); i++)
+    {
+        ipp_t *col = new_media_col(cols[i][0], cols[i][1], cols[i][2]);
+        if (mdb == NULL)
+            mdb = ippAddCollection(attrs, IPP_TAG_PRINTER, "media-col-database", col);
+        else
+            ippSetCollection(attrs, &mdb, i, col);
+        ippDelete(col);
+    }
+
+    db = decode_media_col(mdb);
+
+    /** The sizes which are A4 within the tolerance make a single entry **/
+    g_assert_true(lookup_pwg_size(20990, 29700) == lookup_pwg_size(21000, 29700));
+    g_assert_cmpint(db->num_media, ==, 2);
+    g_assert_cmpstr(db->media[0].name, ==, A4_NAME);
+    g_assert_cmpint(db->media[0].num_margins, ==, 2);
+    assert_margins(&db->media[0], 0, 0, 0, 0, 0);
+    assert_margins(&db->media[0], 1, 423, 423, 423, 423);
+    g_assert_cmpstr(db->media[1].name, ==, LETTER_NAME);
+    g_assert_cmpint(db->media[1].num_margins, ==, 1);
+    assert_margins(&db->media[1], 0, 635, 635, 635, 635);
+
+    unref_MediaDatabase(db);
+    ippDelete(attrs);
+}
+
+static void test_decode_media_ready(void)
+{
+    static const char *const ready[] = {LETTER_NAME, A4_NAME, "no-such-size", A4_NAME};
+    ipp_t *attrs = ippNew();
+    ipp_attribute_t *attr;
+    MediaDatabase *db;
+
+    attr = ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "media-ready",
+                         G_N_ELEMENTS(ready), NULL, ready);
+
+    db = decode_media_ready(attr);
+    g_assert_cmpint(db->num_media, ==, 2);
+    g_assert_cmpstr(db->media[0].name, ==, A4_NAME);
+    g_assert_cmpint(db->media[0].num_margins, ==, 0);
+    g_assert_cmpstr(db->media[1].name, ==, LETTER_NAME);
+    g_assert_cmpint(db->media[1].num_margins, ==, 0);
+
+    unref_MediaDatabase(db);
+    ippDelete(attrs);
+}
+
+/**************Capability disk cache************************/
+#define TEST_URI "ipp://localhost/printers/test"
+
+static PrinterCapabilities *new_test_capabilities(void)
+{
+    static const char *const sides[] = {"one-sided", "two-sided-long-edge"};
+    PrinterCapabilities *c = new_PrinterCapabilities();
+    MediaEntry entries[2];
+    int i;
+
+    c->uri = cpdbGetStringCopy(TEST_URI);
+    c->printer_name = cpdbGetStringCopy("test");
+    c->config_change_time = cpdbGetStringCopy("1700000000");
+    c->arena = arena_new();
+
+    c->num_options = 2;
+    c->options = arena_alloc(c->arena, sizeof(Option) * c->num_options);
+    c->options[0].option_name = "sides";
+    c->options[0].default_value = "one-sided";
+    c->options[0].num_supported = G_N_ELEMENTS(sides);
+    c->options[0].supported_values = arena_alloc(c->arena, sizeof(char *) * G_N_ELEMENTS(sides));
+    for (i = 0; i < G_N_ELEMENTS(sides); i++)
+        c->options[0].supported_values[i] = arena_strdup(c->arena, sides[i]);
+    c->options[1].option_name = "job-name";
+    c->options[1].default_value = "NA";
+    c->options[1].num_supported = 0;
+    c->options[1].supported_values = NULL;
+
+    memset(entries, 0, sizeof(entries));
+    entries[0].size = lookup_pwg_size(21000, 29700);
+    set_margins(&entries[0], 423, 423, 423, 423);
+    entries[1].size = lookup_pwg_size(21590, 27940);
+    c->media_db = group_media_entries(entries, G_N_ELEMENTS(entries));
+    c->num_media = c->media_db->num_media;
+    c->media = c->media_db->media;
+    return c;
+}
+
+static void write_cache_file(const char *uri, GVariant *v)
+{
+    char *path = capabilities_cache_path(uri);
+    g_variant_ref_sink(v);
+    g_assert_true(g_file_set_contents(path, g_variant_get_data(v), g_variant_get_size(v), NULL));
+    g_variant_unref(v);
+    g_free(path);
+}
+
+static void test_capabilities_round_trip(void)
+{
+    PrinterCapabilities *c = new_test_capabilities();
+    PrinterCapabilities *loaded;
+    int i;
+
+    store_capabilities_on_disk(c);
+
+    loaded = load_capabilities_from_disk(TEST_URI, "1700000000");
+    g_assert_nonnull(loaded);
+    g_assert_nonnull(loaded->serialized);
+    g_assert_cmpstr(loaded->uri, ==, TEST_URI);
+    g_assert_cmpstr(loaded->config_change_time, ==, "1700000000");
+
+    g_assert_cmpint(loaded->num_options, ==, c->num_options);
+    for (i = 0; i < c->num_options; i++)
+    {
+        g_assert_cmpstr(loaded->options[i].option_name, ==, c->options[i].option_name);
+        g_assert_cmpstr(loaded->options[i].default_value, ==, c->options[i].default_value);
+        g_assert_cmpint(loaded->options[i].num_supported, ==, c->options[i].num_supported);
+    }
+    g_assert_cmpstr(loaded->options[0].supported_values[1], ==, "two-sided-long-edge");
+
+    g_assert_cmpint(loaded->num_media, ==, 2);
+    g_assert_cmpstr(loaded->media[0].name, ==, A4_NAME);
+    g_assert_cmpint(loaded->media[0].num_margins, ==, 1);
+    assert_margins(&loaded->media[0], 0, 423, 423, 423, 423);
+    g_assert_cmpstr(loaded->media[1].name, ==, LETTER_NAME);
+    g_assert_cmpint(loaded->media[1].num_margins, ==, 0);
+    unref_PrinterCapabilities(loaded);
+
+    /** Any change time will do if the caller doesn't know it **/
+    loaded = load_capabilities_from_disk(TEST_URI, NULL);
+    g_assert_nonnull(loaded);
+    unref_PrinterCapabilities(loaded);
+
+    /** A newer configuration outdates the file **/
+    g_assert_null(load_capabilities_from_disk(TEST_URI, "1700000001"));
+
+    unref_PrinterCapabilities(c);
+}
+
+static void test_capabilities_rejected(void)
+{
+    PrinterCapabilities *c = new_test_capabilities();
+    GVariant *empty_options = g_variant_new_array(G_VARIANT_TYPE("(ssas)"), NULL, 0);
+    GVariant *empty_media = g_variant_new_array(G_VARIANT_TYPE("(siia(iiii))"), NULL, 0);
+    char *path;
+
+    /** Another version of the format **/
+    write_cache_file(TEST_URI, g_variant_new("(uss@a(ssas)@a(siia(iiii)))",
+                                             CAPS_CACHE_VERSION + 1, TEST_URI, "",
+                                             empty_options, empty_media));
+    g_assert_null(load_capabilities_from_disk(TEST_URI, NULL));
+
+    /** The file of another printer **/
+    write_cache_file(TEST_URI, g_variant_new("(uss@a(ssas)@a(siia(iiii)))",
+                                             CAPS_CACHE_VERSION, "ipp://localhost/printers/other", "",
+                                             g_variant_new_array(G_VARIANT_TYPE("(ssas)"), NULL, 0),
+                                             g_variant_new_array(G_VARIANT_TYPE("(siia(iiii))"), NULL, 0)));
+    g_assert_null(load_capabilities_from_disk(TEST_URI, NULL));
+
+    /** A file cut short isn't in normal form **/
+    store_capabilities_on_disk(c);
+    path = capabilities_cache_path(TEST_URI);
+    g_assert_cmpint(truncate(path, 20), ==, 0);
+    g_assert_null(load_capabilities_from_disk(TEST_URI, NULL));
+
+    /** Nor is garbage **/
+    g_assert_true(g_file_set_contents(path, "not a variant at all, not even close", -1, NULL));
+    g_assert_null(load_capabilities_from_disk(TEST_URI, NULL));
+
+    unlink(path);
+    g_assert_null(load_capabilities_from_disk(TEST_URI, NULL));
+    g_free(path);
+    unref_PrinterCapabilities(c);
+}
+
+/**************Arena allocator*****************************/
+static void test_arena(void)
+{
+    Arena *a = arena_new();
+    char *small[64];
+    char *big, *after;
+    int i;
+
+    /** Small allocations are aligned, zeroed and share blocks **/
+    for (i = 0; i < G_N_ELEMENTS(small); i++)
+    {
+        small[i] = arena_alloc(a, 24);
+        g_assert_cmpuint((gsize)small[i] % 16, ==, 0);
+        g_assert_cmpint(small[i][0], ==, 0);
+        g_assert_cmpint(small[i][23], ==, 0);
+        memset(small[i], 0xff, 24);
+    }
+    g_assert_cmpuint(a->num_blocks, ==, 1);
+    g_assert_true(small[1] == small[0] + 32);
+
+    /** A large allocation gets a block of its own, and the current block
+     * keeps being filled after it **/
+    big = arena_alloc(a, ARENA_BLOCK_SIZE);
+    g_assert_cmpuint(a->num_blocks, ==, 2);
+    g_assert_cmpint(big[ARENA_BLOCK_SIZE - 1], ==, 0);
+    after = arena_alloc(a, 24);
+    g_assert_true(after == small[G_N_ELEMENTS(small) - 1] + 32);
+
+    /** Filling the current block starts a new one **/
+    while (a->num_blocks == 2)
+        arena_alloc(a, 1024);
+    g_assert_cmpuint(a->num_blocks, ==, 3);
+
+    g_assert_cmpstr(arena_strdup(a, "media-type"), ==, "media-type");
+    g_assert_null(arena_strdup(a, NULL));
+    g_assert_cmpstr(arena_value(a, NULL), ==, "NA");
+    g_assert_cmpuint(a->num_allocs, >, G_N_ELEMENTS(small) + 2);
+
+    arena_free(a);
+    arena_free(NULL);
+
+    /** A fresh arena starts from nothing again **/
+    a = arena_new();
+    g_assert_cmpuint(a->num_blocks, ==, 0);
+    g_assert_cmpuint(a->bytes, ==, 0);
+    g_assert_nonnull(arena_alloc(a, 1));
+    g_assert_cmpuint(a->num_blocks, ==, 1);
+    arena_free(a);
+}
+
+/**************IPP keywords*********************************/
+static void test_ipp_keywords(void)
+{
+    static const struct
+    {
+        const char *name;
+        int id;
+        unsigned flags;
+    } keywords[] = {
+        {"media", KW_MEDIA, KW_HARDCODED},
+        {"media-col", KW_MEDIA_COL, KW_HARDCODED},
+        {"media-type", KW_MEDIA_TYPE, 0},
+        {"orientation-requested", KW_ORIENTATION_REQUESTED, KW_HARDCODED | KW_ORIENTATION},
+        {"print-quality", KW_PRINT_QUALITY, KW_PRINT_QUALITY_OPTION},
+        {"billing-info", KW_BILLING_INFO, 0},
+    };
+    const IppKeyword *kw;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(keywords); i++)
+    {
+        kw = lookup_ipp_keyword(keywords[i].name);
+        g_assert_nonnull(kw);
+        g_assert_cmpstr(kw->name, ==, keywords[i].name);
+        g_assert_cmpint(kw->id, ==, keywords[i].id);
+        g_assert_cmpuint(kw->flags, ==, keywords[i].flags);
+        g_assert_cmpuint(ipp_keyword_flags(keywords[i].name), ==, keywords[i].flags);
+    }
+
+    /** Only exact matches count **/
+    g_assert_null(lookup_ipp_keyword("Media"));
+    g_assert_null(lookup_ipp_keyword("PRINT-QUALITY"));
+    g_assert_null(lookup_ipp_keyword("medi"));
+    g_assert_null(lookup_ipp_keyword("media-"));
+    g_assert_null(lookup_ipp_keyword("media-col-database"));
+    g_assert_null(lookup_ipp_keyword("draft"));
+    g_assert_null(lookup_ipp_keyword(""));
+    g_assert_null(lookup_ipp_keyword(NULL));
+    g_assert_cmpuint(ipp_keyword_flags("finishings-col"), ==, 0);
+
+    /** print-quality choices map to their enum values whatever their case,
+     * anything else stays **/
+    g_assert_cmpstr(map_print_quality("draft"), ==, "3");
+    g_assert_cmpstr(map_print_quality("normal"), ==, "4");
+    g_assert_cmpstr(map_print_quality("high"), ==, "5");
+    g_assert_cmpstr(map_print_quality("High"), ==, "5");
+    g_assert_cmpstr(map_print_quality("DRAFT"), ==, "3");
+    g_assert_cmpstr(map_print_quality("best"), ==, "best");
+}
+
+/**************Notifier event debouncing********************/
+static int pending_event(BackendObj *b, const char *printer_name)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(b->pending_events, printer_name));
+}
+
+static void test_debounce_coalescing(void)
+{
+    BackendObj *b = get_new_BackendObj();
+    gint64 deadline;
+
+    /** Repeated events of a printer make one entry, and the deadline is
+     * set by the first of them **/
+    queue_printer_event(b, "a", PRINTER_EVENT_MODIFIED);
+    g_assert_cmpuint(b->debounce_source, !=, 0);
+    deadline = b->debounce_deadline;
+    queue_printer_event(b, "a", PRINTER_EVENT_MODIFIED);
+    queue_printer_event(b, "a", PRINTER_EVENT_ADDED);
+    g_assert_cmpint(b->debounce_deadline, ==, deadline);
+    g_assert_cmpuint(g_hash_table_size(b->pending_events), ==, 1);
+    g_assert_cmpint(pending_event(b, "a"), ==, PRINTER_EVENT_ADDED | PRINTER_EVENT_MODIFIED);
+
+    /** A printer which came and went leaves nothing behind **/
+    queue_printer_event(b, "a", PRINTER_EVENT_DELETED);
+    g_assert_false(g_hash_table_contains(b->pending_events, "a"));
+
+    /** A deletion cancels a modification **/
+    queue_printer_event(b, "b", PRINTER_EVENT_MODIFIED);
+    queue_printer_event(b, "b", PRINTER_EVENT_DELETED);
+    g_assert_cmpint(pending_event(b, "b"), ==, PRINTER_EVENT_DELETED);
+
+    /** Deleted and added again means the queue was re-created; deleting
+     * it once more leaves the first deletion **/
+    queue_printer_event(b, "b", PRINTER_EVENT_ADDED);
+    g_assert_cmpint(pending_event(b, "b"), ==, PRINTER_EVENT_DELETED | PRINTER_EVENT_ADDED);
+    queue_printer_event(b, "b", PRINTER_EVENT_DELETED);
+    g_assert_cmpint(pending_event(b, "b"), ==, PRINTER_EVENT_DELETED);
+
+    g_assert_cmpuint(b->events_received, ==, 8);
+    g_assert_cmpint(b->debounce_deadline, ==, deadline);
+
+    g_source_remove(b->debounce_source);
+    g_hash_table_remove_all(b->pending_events);
+}
+
+/**************Batched printer signals**********************/
+static cups_dest_t *new_test_dest(const char *name)
+{
+    cups_dest_t *dest = NULL;
+
+    cupsAddDest(name, NULL, 0, &dest);
+    dest->num_options = cupsAddOption("printer-info", "Test printer", dest->num_options, &dest->options);
+    dest->num_options = cupsAddOption("printer-state", "3", dest->num_options, &dest->options);
+    dest->num_options = cupsAddOption("printer-is-accepting-jobs", "true", dest->num_options, &dest->options);
+    return dest;
+}
+
+static void test_batched_signals(void)
+{
+    BackendObj *b = get_new_BackendObj();
+    Dialog *d = get_new_Dialog();
+    cups_dest_t *dest = new_test_dest("a");
+    PrinterCUPS *p;
+
+    d->batch_signals = TRUE;
+    g_hash_table_insert(b->dialogs, cpdbGetStringCopy(":1.1"), d);
+
+    p = add_printer_to_dialog(b, ":1.1", dest);
+    g_assert_nonnull(p);
+    g_assert_cmpstr(p->summary.info, ==, "Test printer");
+
+    /** Additions of a printer collapse into one **/
+    send_printer_added_signal(b, ":1.1", p);
+    send_printer_added_signal(b, ":1.1", p);
+    g_assert_cmpuint(g_hash_table_size(d->pending_added), ==, 1);
+    g_assert_cmpuint(d->batch_source, !=, 0);
+
+    /** A removal drops the pending addition of the printer **/
+    send_printer_removed_signal(b, ":1.1", "a");
+    g_assert_cmpuint(g_hash_table_size(d->pending_added), ==, 0);
+    g_assert_true(g_hash_table_contains(d->pending_removed, "a"));
+
+    /** The pending signals outlive the printer **/
+    remove_printer_from_dialog(b, ":1.1", "a");
+    g_assert_false(g_hash_table_contains(b->printers, "a"));
+    g_assert_true(g_hash_table_contains(d->pending_removed, "a"));
+
+    g_hash_table_remove(b->dialogs, ":1.1");
+    cupsFreeDests(1, dest);
+}
+
+/**************Shared printer discovery********************/
+static void test_shared_discovery(void)
+{
+    BackendObj *b = get_new_BackendObj();
+    PrinterSnapshot *s = g_new0(PrinterSnapshot, 1);
+    cups_dest_t *dest = new_test_dest("a");
+    const char *names[] = {":1.1", ":1.2"};
+    EnumJob *job;
+
+    for (int i = 0; i < 2; i++)
+    {
+        Dialog *d = get_new_Dialog();
+        d->batch_signals = TRUE;
+        g_hash_table_insert(b->dialogs, cpdbGetStringCopy(names[i]), d);
+    }
+
+    /** Nothing changed since the last enumeration, so its snapshot is
+     * the answer and nothing gets queued **/
+    s->ref_count = 1;
+    s->generation = b->generation;
+    s->printers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_dest);
+    g_hash_table_insert(s->printers, dest->name, dest);
+    cache_snapshot(b, s);
+    start_printer_discovery(b, ":1.1");
+    g_assert_null(b->discovery_job);
+    g_assert_true(dialog_contains_printer(b, ":1.1", "a"));
+
+    /** After a change, the second dialog joins the discovery queued for
+     * the first one **/
+    invalidate_printer_snapshots(b);
+    start_printer_discovery(b, ":1.1");
+    job = b->discovery_job;
+    g_assert_nonnull(job);
+    start_printer_discovery(b, ":1.2");
+    g_assert_true(b->discovery_job == job);
+    g_assert_cmpuint(g_hash_table_size(b->discovery_dialogs), ==, 2);
+
+    /** It goes on until the last of its dialogs goes away **/
+    set_dialog_cancel(b, ":1.1");
+    g_assert_true(b->discovery_job == job);
+    set_dialog_cancel(b, ":1.2");
+    g_assert_null(b->discovery_job);
+    g_assert_cmpuint(g_hash_table_size(b->discovery_dialogs), ==, 0);
+
+    g_hash_table_remove(b->dialogs, ":1.1");
+    g_hash_table_remove(b->dialogs, ":1.2");
+    unref_PrinterSnapshot(s);
+}
+
+int main(int argc, char *argv[])
+{
+    /** Keep the cache files of the tests out of the user's cache **/
+    char *cache_dir = g_dir_make_tmp("test-backend-helper-XXXXXX", NULL);
+    int ret;
+
+    g_assert_nonnull(cache_dir);
+    g_setenv("XDG_CACHE_HOME", cache_dir, TRUE);
+
+    /** and don't connect to the printers the tests make up **/
+    g_setenv("CPDB_CUPS_WARMUP_THREADS", "0", TRUE);
+
+    g_test_init(&argc, &argv, NULL);
+    map = get_new_Mappings();
+
+    g_test_add_func("/media/group-entries", test_group_media_entries);
+    g_test_add_func("/media/decode-media-col", test_decode_media_col);
+    g_test_add_func("/media/decode-media-ready", test_decode_media_ready);
+    g_test_add_func("/capabilities/round-trip", test_capabilities_round_trip);
+    g_test_add_func("/capabilities/rejected", test_capabilities_rejected);
+    g_test_add_func("/arena/allocations", test_arena);
+    g_test_add_func("/ipp-keywords/lookup", test_ipp_keywords);
+    g_test_add_func("/notifier/coalescing", test_debounce_coalescing);
+    g_test_add_func("/signals/batching", test_batched_signals);
+    g_test_add_func("/discovery/shared", test_shared_discovery);
+
+    ret = g_test_run();
+
+    /** The tests leave only empty directories behind **/
+    char *dir = g_build_filename(cache_dir, "cpdb", "backend-cups", "capabilities", NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    dir = g_build_filename(cache_dir, "cpdb", "backend-cups", NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    dir = g_build_filename(cache_dir, "cpdb", NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    g_rmdir(cache_dir);
+    g_free(cache_dir);
+    return ret;
+}